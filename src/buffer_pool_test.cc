@@ -0,0 +1,68 @@
+// Fast And Furious column database
+//
+// Checks size classes of util::BufferPool: a buffer of 2^k bytes is served
+// from class k, its header doesn't count towards the size. Buffers of huge
+// page classes are checked both allocated and mapped.
+// Usage: ./buffer_pool_test
+
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+
+#include "utils/buffer_pool.h"
+
+using util::BufferPool;
+
+static const std::size_t kHugePageBytes = 2 * 1024 * 1024;
+
+static int failures = 0;
+
+static void expect(bool condition, const char* what, int bits) {
+  if (!condition) {
+    printf("buffer_pool_test: %s for 2^%d bytes\n", what, bits);
+    failures++;
+  }
+}
+
+static void checkClasses(BufferPool& pool, bool hugePages) {
+  for (int bits = BufferPool::kMinClassBits;
+       bits <= BufferPool::kMaxClassBits; bits++) {
+    std::size_t bytes = std::size_t(1) << bits;
+    uint32_t size_class = bits - BufferPool::kMinClassBits;
+    expect(BufferPool::ClassOf(bytes) == size_class, "wrong class", bits);
+    expect(BufferPool::ClassOf(bytes + 1) == size_class + 1,
+           "wrong class of one byte more", bits);
+    void* buffer = pool.Allocate(bytes);
+    expect(BufferPool::Capacity(buffer) == bytes, "wrong capacity", bits);
+    expect(reinterpret_cast<uintptr_t>(buffer) % BufferPool::kAlignment == 0,
+           "unaligned buffer", bits);
+    // mapped buffers start at a huge page
+    expect(!hugePages || bytes < kHugePageBytes ||
+           reinterpret_cast<uintptr_t>(buffer) % kHugePageBytes == 0,
+           "buffer not at a huge page", bits);
+    // a fresh one while the first is taken
+    void* other = pool.Allocate(bytes);
+    expect(other != buffer, "buffer served twice", bits);
+    memset(other, 1, bytes);
+    pool.Release(other);
+    // released buffers are served again
+    void* again = pool.Allocate(bytes);
+    expect(again == other, "buffer not reused", bits);
+    pool.Release(again);
+    pool.Release(buffer);
+  }
+}
+
+int main() {
+  BufferPool& pool = BufferPool::Instance();
+  // fresh buffers are mapped first, then the pool serves them again
+  pool.set_huge_pages(true);
+  checkClasses(pool, true);
+  pool.set_huge_pages(false);
+  checkClasses(pool, false);
+  expect(BufferPool::ClassOf(1) == 0, "wrong class of a byte", 0);
+  if (failures == 0) {
+    printf("buffer_pool_test: OK\n");
+  }
+  return failures == 0 ? 0 : 1;
+}
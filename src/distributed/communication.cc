@@ -1,5 +1,6 @@
 #include "distributed/communication.h"
 #include <stdarg.h>
+#include <cstring>
 
 void Communication::debugPrint(const char* fmt, ...) {
   va_list ap;
@@ -17,7 +18,26 @@ void Communication::debugPrint(const char* fmt, ...) {
   fflush(stdout);
 }
 
-query::NetworkMessage* Communication::getMessage(bool blocking) {
+void Communication::sendMessage(int node, const query::NetworkMessage& message,
+    const PacketBuffers& payload) {
+  uint32_t length = message.ByteSizeLong();
+  string header(alignPacket(sizeof(length) + length), 0);
+  memcpy(&header[0], &length, sizeof(length));
+  message.SerializeWithCachedSizesToArray((uint8_t*) &header[sizeof(length)]);
+  PacketBuffersSender* sender = dynamic_cast<PacketBuffersSender*>(nei);
+  if (sender != NULL) {
+    PacketBuffers buffers(1, std::make_pair(header.data(), header.size()));
+    buffers.insert(buffers.end(), payload.begin(), payload.end());
+    sender->SendPacket(node, buffers);
+  } else {
+    for (size_t i = 0; i < payload.size(); i++)
+      header.append(payload[i].first, payload[i].second);
+    nei->SendPacket(node, header.data(), header.size());
+  }
+}
+
+query::NetworkMessage* Communication::getMessage(bool blocking,
+    boost::shared_ptr<ReceivedPacket>* packet) {
   char *data;
   size_t data_len;
   query::NetworkMessage *message;
@@ -29,14 +49,19 @@ query::NetworkMessage* Communication::getMessage(bool blocking) {
   } else {
     data = nei->ReadPacketBlocking(&data_len);
   }
+  uint32_t length;
+  memcpy(&length, data, sizeof(length));
+  assert(sizeof(length) + length <= data_len);
   message = new query::NetworkMessage();
-  message->ParseFromString(string(data, data_len));
-  delete[] data;
+  message->ParseFromArray(data + sizeof(length), length);
+  packet->reset(new ReceivedPacket(data,
+        data + alignPacket(sizeof(length) + length)));
 
   return message;
 }
 
-void Communication::parseMessage(query::NetworkMessage *message, bool allow_data) {
+void Communication::parseMessage(query::NetworkMessage *message, bool allow_data,
+    const boost::shared_ptr<ReceivedPacket>& packet) {
   if (message->stripe_size() > 0) {
     query::NetworkMessage::Stripe *st;
     for (int i = 0; i < message->stripe_size(); i++) {
@@ -47,7 +72,11 @@ void Communication::parseMessage(query::NetworkMessage *message, bool allow_data
   } else if (message->has_data_request()) {
     requests.push(message->release_data_request());
   } else if (allow_data && message->has_data_response()) {
-    responses.push(message->release_data_response());
+    responses.push(ReceivedResponse(message->release_data_response(), packet));
+  } else if (message->has_file_request()) {
+    fileRequests.push(message->release_file_request());
+  } else if (message->has_file_assignment()) {
+    files.push(message->file_assignment().file());
   } else {
     debugPrint("ERROR: parseMessage(%s, %b)", message->DebugString().c_str(), allow_data);
     assert(false);
@@ -60,11 +89,12 @@ void Communication::getJob() {
   /** Wait until a job occures, than store it in a jobs queue. */
   debugPrint("Awaiting for a job");
   query::NetworkMessage *message;
+  boost::shared_ptr<ReceivedPacket> packet;
 
   while (jobs.size() == 0) {
-    message = getMessage(true);
-    parseMessage(message, false); // there should be no incoming data while
-                                  // awaiting for a job
+    message = getMessage(true, &packet);
+    parseMessage(message, false, packet); // there should be no incoming data
+                                          // while awaiting for a job
   }
   return ;
 }
@@ -73,10 +103,11 @@ void Communication::getRequest() {
   /** Wait until a data request occures, than store it in a requests queue */
   debugPrint("Awaiting for data request");
   query::NetworkMessage *message;
+  boost::shared_ptr<ReceivedPacket> packet;
 
   while (requests.size() == 0) {
-    message = getMessage(true);
-    parseMessage(message, true);
+    message = getMessage(true, &packet);
+    parseMessage(message, true, packet);
   }
   return ;
 }
@@ -84,14 +115,44 @@ void Communication::getRequest() {
 void Communication::getResponse() {
   debugPrint("Awaiting for data response");
   query::NetworkMessage *message;
+  boost::shared_ptr<ReceivedPacket> packet;
 
   while (responses.size() == 0) {
-    message = getMessage(true);
-    parseMessage(message, true);
+    message = getMessage(true, &packet);
+    parseMessage(message, true, packet);
+  }
+  return ;
+}
+
+void Communication::getFileRequest() {
+  debugPrint("Awaiting for file request");
+  query::NetworkMessage *message;
+  boost::shared_ptr<ReceivedPacket> packet;
+
+  while (fileRequests.size() == 0) {
+    message = getMessage(true, &packet);
+    parseMessage(message, false, packet);
   }
   return ;
 }
 
+int Communication::requestFile() {
+  query::NetworkMessage com;
+  com.mutable_file_request()->set_node(nei->my_node_number());
+  sendMessage(SCHEDULER_NODE, com);
+
+  // data requests of consumers may come in the meantime
+  query::NetworkMessage *message;
+  boost::shared_ptr<ReceivedPacket> packet;
+  while (files.size() == 0) {
+    message = getMessage(true, &packet);
+    parseMessage(message, false, packet);
+  }
+  int file = files.front();
+  files.pop();
+  debugPrint("Assigned file %d", file);
+  return file;
+}
 
 DataSourceInterface*
 Communication::openSourceInterface(int fileId) {
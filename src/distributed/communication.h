@@ -5,12 +5,14 @@
 #include <queue>
 #include <map>
 #include <utility>
+#include <boost/shared_ptr.hpp>
 
 #include "global.h"
 #include "operators/operation.h"
 #include "operators/column.h"
 #include "proto/operations.pb.h"
 #include "node_environment/node_environment.h"
+#include "utils/buffer_pool.h"
 #include "distributed/packet.h"
 #include "distributed/input_buffer.h"
 #include "distributed/output_buffer.h"
@@ -20,6 +22,57 @@ using std::vector;
 using std::map;
 using std::pair;
 
+/*
+ * Every network packet is a NetworkMessage preceded by its length (uint32)
+ * and optionally followed by a payload, starting at a multiple of 8 bytes.
+ * A payload holds data of the columns of a DataPacket one after another,
+ * each padded to a multiple of 8 bytes, so received chunks can point into
+ * it without copying.
+ */
+const int PACKET_ALIGNMENT = 8;
+
+inline size_t alignPacket(size_t offset) {
+  return (offset + PACKET_ALIGNMENT - 1) / PACKET_ALIGNMENT * PACKET_ALIGNMENT;
+}
+
+/** The scheduler hands out input files to scans asking for them */
+const int SCHEDULER_NODE = 0;
+/** ScanFileOperation source of scans asking for files */
+const int ASK_FOR_FILES = -1;
+
+/**
+ * Received packet, kept alive by data responses and column chunks pointing
+ * into its payload, see UnionOperation::processReceivedData.
+ */
+class ReceivedPacket {
+  char* data;
+  vector<char*> buffers;
+ public:
+  const char* payload;
+
+  ReceivedPacket(char* data_, const char* payload_):
+    data(data_), payload(payload_) { }
+
+  /** Memory of the same lifetime, e.g. for decoded columns */
+  char* allocate(size_t bytes) {
+    buffers.push_back(static_cast<char*>(
+          util::BufferPool::Instance().Allocate(bytes)));
+    return buffers.back();
+  }
+
+  ~ReceivedPacket() {
+    // ReadPacket* hands out packets to be destroyed with delete[]
+    delete[] data;
+    util::BufferPool& pool = util::BufferPool::Instance();
+    for (unsigned i = 0 ; i < buffers.size() ; ++i) {
+      pool.Release(buffers[i]);
+    }
+  }
+};
+
+typedef pair<query::DataResponse*, boost::shared_ptr<ReceivedPacket> >
+  ReceivedResponse;
+
 class Communication {
   public:
     Communication(NodeEnvironmentInterface *nei, const int *stripe)
@@ -40,12 +93,28 @@ class Communication {
     // key: stripe id -> queue of request for gievn id
     map<int, queue<query::DataRequest *> > delayed_requests;
 
-    queue<query::DataResponse *> responses;
+    queue<ReceivedResponse> responses;
+
+    // file requests of scans, at the scheduler
+    queue<query::FileRequest *> fileRequests;
+    // files assigned by the scheduler, -1 if there are no more
+    queue<int> files;
 
-    /** Gets a communication message from network interface */
-    query::NetworkMessage* getMessage(bool blocking);
+    /**
+     * Sends a message with an optional payload, buffers of which are written
+     * to the socket as they are
+     */
+    void sendMessage(int node, const query::NetworkMessage& message,
+        const PacketBuffers& payload = PacketBuffers());
+    /**
+     * Gets a communication message from network interface, parsed in place.
+     * The packet is set to the received one, responses may refer to it.
+     */
+    query::NetworkMessage* getMessage(bool blocking,
+        boost::shared_ptr<ReceivedPacket>* packet);
     /** Parses a communication method and stores contained information */
-    void parseMessage(query::NetworkMessage *message, bool allow_data);
+    void parseMessage(query::NetworkMessage *message, bool allow_data,
+        const boost::shared_ptr<ReceivedPacket>& packet);
 
     /** Wait until any job occurs */
     void getJob();
@@ -53,6 +122,10 @@ class Communication {
     void getRequest();
     /** Wait until any data response occurs */
     void getResponse();
+    /** Wait until any file request occurs */
+    void getFileRequest();
+    /** Asks the scheduler for the next input file, -1 if there are no more */
+    int requestFile();
 
     /** Open new DataSourceInterface, caller is responsible for deallocation */
     DataSourceInterface* openSourceInterface(int fileId);
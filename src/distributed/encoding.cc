@@ -0,0 +1,415 @@
+#include "distributed/encoding.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <vector>
+#include <stdint.h>
+#include <immintrin.h>
+
+#include "global.h"
+
+using std::vector;
+
+namespace {
+
+const int DICTIONARY_MAX = 256; // values
+const int DICTIONARY_SLOTS = 512; // power of two
+const int PADDING = 8; // bytes after packed bits
+
+// Bits {{{
+int bitsFor(uint32_t value) {
+  int width = 0;
+  while (width < 32 && (value >> width) != 0) {
+    ++width;
+  }
+  return width;
+}
+
+size_t packedSize(int rows, int width) {
+  return ((size_t) rows * width + 7) / 8 + PADDING;
+}
+
+void packBits(const uint32_t* values, int n, int width, string* target) {
+  size_t start = target->size();
+  target->resize(start + packedSize(n, width), 0);
+  unsigned char* data = (unsigned char*) &(*target)[start];
+  uint64_t buffer = 0;
+  int bits = 0;
+  for (int i = 0 ; i < n ; ++i) {
+    buffer |= (uint64_t) values[i] << bits;
+    bits += width;
+    while (bits >= 8) {
+      *data++ = buffer;
+      buffer >>= 8;
+      bits -= 8;
+    }
+  }
+  if (bits > 0) {
+    *data = buffer;
+  }
+}
+
+/** Rows [from, n), plus base */
+void unpackScalar(const unsigned char* data, int from, int n, int width,
+    uint32_t base, uint32_t* target) {
+  uint32_t mask = width == 32 ? 0xffffffff : (1u << width) - 1;
+  for (int i = from ; i < n ; ++i) {
+    uint64_t bit = (uint64_t) i * width;
+    uint64_t word;
+    memcpy(&word, data + bit / 8, sizeof(word));
+    target[i] = ((word >> (bit & 7)) & mask) + base;
+  }
+}
+
+/** 8 values a time gathered by their byte offset, widths up to 25 bits */
+__attribute__((target("avx2")))
+void unpackAvx2(const unsigned char* data, int n, int width, uint32_t base,
+    uint32_t* target) {
+  const __m256i mask = _mm256_set1_epi32((1u << width) - 1);
+  const __m256i seven = _mm256_set1_epi32(7);
+  const __m256i bases = _mm256_set1_epi32(base);
+  const __m256i offsets = _mm256_mullo_epi32(
+      _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(width));
+  int i = 0;
+  for ( ; i + 8 <= n ; i += 8) {
+    __m256i bit = _mm256_add_epi32(offsets, _mm256_set1_epi32(i * width));
+    __m256i words = _mm256_i32gather_epi32((const int*) data,
+        _mm256_srli_epi32(bit, 3), 1);
+    words = _mm256_srlv_epi32(words, _mm256_and_si256(bit, seven));
+    words = _mm256_add_epi32(_mm256_and_si256(words, mask), bases);
+    _mm256_storeu_si256((__m256i*) (target + i), words);
+  }
+  unpackScalar(data, i, n, width, base, target);
+}
+
+bool hasAvx2() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+
+const bool avx2 = hasAvx2();
+
+void unpackBits(const unsigned char* data, int n, int width, uint32_t base,
+    uint32_t* target) {
+  if (avx2 && width <= 25) {
+    unpackAvx2(data, n, width, base, target);
+  } else {
+    unpackScalar(data, 0, n, width, base, target);
+  }
+}
+// }}}
+
+// Raw values {{{
+template<class T>
+void append(string* target, T value) {
+  target->append((const char*) &value, sizeof(value));
+}
+
+template<class T>
+T read(const char*& data) {
+  T value;
+  memcpy(&value, data, sizeof(value));
+  data += sizeof(value);
+  return value;
+}
+// }}}
+
+/** Distinct values up to DICTIONARY_MAX, compared bitwise */
+template<class W>
+struct Dictionary {
+  W values[DICTIONARY_MAX];
+  int slots[DICTIONARY_SLOTS]; // index of the value + 1, 0 if empty
+  int size;
+  bool full; // there were more distinct values
+
+  Dictionary(): size(0), full(false) {
+    memset(slots, 0, sizeof(slots));
+  }
+
+  /** Code of the value, -1 if there's no room for it */
+  int code(W value) {
+    unsigned slot = ((uint64_t) value * 0x9E3779B97F4A7C15ULL) >> 55;
+    while (slots[slot] != 0) {
+      if (values[slots[slot] - 1] == value) {
+        return slots[slot] - 1;
+      }
+      slot = (slot + 1) & (DICTIONARY_SLOTS - 1);
+    }
+    if (size == DICTIONARY_MAX) {
+      full = true;
+      return -1;
+    }
+    values[size] = value;
+    slots[slot] = ++size;
+    return size - 1;
+  }
+};
+
+/** Statistics of a column, W is the word of the type's bits */
+template<class W>
+struct Statistics {
+  Dictionary<W> dictionary;
+  int runs;
+
+  Statistics(const W* values, int n): runs(0) {
+    for (int i = 0 ; i < n ; ++i) {
+      if (i == 0 || values[i] != values[i - 1]) {
+        ++runs;
+        if (!dictionary.full) {
+          dictionary.code(values[i]);
+        }
+      }
+    }
+  }
+
+  size_t runLengthSize() {
+    return sizeof(int32_t) + runs * (sizeof(W) + sizeof(int32_t));
+  }
+
+  size_t dictionarySize(int rows) {
+    if (dictionary.full) {
+      return (size_t) -1;
+    }
+    return sizeof(int32_t) + dictionary.size * sizeof(W) + 1 +
+      packedSize(rows, bitsFor(dictionary.size - 1));
+  }
+};
+
+// Encoders {{{
+template<class W>
+void packRunLength(const W* values, int n, int runs, string* target) {
+  append<int32_t>(target, runs);
+  vector<int> starts(runs + 1);
+  int r = 0;
+  for (int i = 0 ; i < n ; ++i) {
+    if (i == 0 || values[i] != values[i - 1]) {
+      append(target, values[i]);
+      starts[r++] = i;
+    }
+  }
+  starts[runs] = n;
+  for (r = 0 ; r < runs ; ++r) {
+    append<int32_t>(target, starts[r + 1] - starts[r]);
+  }
+}
+
+template<class W>
+void packDictionary(const W* values, int n, Dictionary<W>* dictionary,
+    string* target) {
+  append<int32_t>(target, dictionary->size);
+  target->append((const char*) dictionary->values,
+      dictionary->size * sizeof(W));
+  int width = bitsFor(dictionary->size - 1);
+  append<uint8_t>(target, width);
+  uint32_t* codes = new uint32_t[n];
+  for (int i = 0 ; i < n ; ++i) {
+    codes[i] = dictionary->code(values[i]);
+  }
+  packBits(codes, n, width, target);
+  delete[] codes;
+}
+
+void packFrameOfReference(const int32_t* values, int n, int32_t minimum,
+    int width, string* target) {
+  append<int32_t>(target, minimum);
+  append<uint8_t>(target, width);
+  uint32_t* differences = new uint32_t[n];
+  for (int i = 0 ; i < n ; ++i) {
+    differences[i] = (uint32_t) values[i] - (uint32_t) minimum;
+  }
+  packBits(differences, n, width, target);
+  delete[] differences;
+}
+
+/** Shift and width in bytes of XORs of consecutive values */
+void xorDeltaBytes(const uint64_t* values, int n, int* shift, int* width) {
+  uint64_t bits = 0;
+  uint64_t previous = 0;
+  for (int i = 0 ; i < n ; ++i) {
+    bits |= values[i] ^ previous;
+    previous = values[i];
+  }
+  if (bits == 0) {
+    *shift = *width = 0;
+  } else {
+    *shift = __builtin_ctzll(bits) / 8;
+    *width = 8 - __builtin_clzll(bits) / 8 - *shift;
+  }
+}
+
+void packXorDelta(const uint64_t* values, int n, int shift, int width,
+    string* target) {
+  append<uint8_t>(target, shift);
+  append<uint8_t>(target, width);
+  size_t start = target->size();
+  target->resize(start + (size_t) n * width + PADDING);
+  char* data = &(*target)[start];
+  uint64_t previous = 0;
+  for (int i = 0 ; i < n ; ++i) {
+    uint64_t delta = (values[i] ^ previous) >> (shift * 8);
+    memcpy(data + i * width, &delta, sizeof(delta)); // little endian
+    previous = values[i];
+  }
+  target->resize(start + (size_t) n * width);
+}
+// }}}
+
+// Decoders {{{
+template<class W>
+void unpackRunLength(const char* data, W* target) {
+  int runs = read<int32_t>(data);
+  const char* lengths = data + runs * sizeof(W);
+  int i = 0;
+  for (int r = 0 ; r < runs ; ++r) {
+    W value = read<W>(data);
+    int length = read<int32_t>(lengths);
+    for (int end = i + length ; i < end ; ++i) {
+      target[i] = value;
+    }
+  }
+}
+
+template<class W>
+void unpackDictionary(const char* data, int n, W* target) {
+  int size = read<int32_t>(data);
+  W values[DICTIONARY_MAX];
+  memcpy(values, data, size * sizeof(W));
+  data += size * sizeof(W);
+  int width = read<uint8_t>(data);
+  uint32_t* codes = new uint32_t[n];
+  unpackBits((const unsigned char*) data, n, width, 0, codes);
+  for (int i = 0 ; i < n ; ++i) {
+    target[i] = values[codes[i]];
+  }
+  delete[] codes;
+}
+
+void unpackXorDelta(const char* data, int n, uint64_t* target) {
+  int shift = read<uint8_t>(data);
+  int width = read<uint8_t>(data);
+  uint64_t previous = 0;
+  for (int i = 0 ; i < n ; ++i) {
+    uint64_t delta = 0;
+    memcpy(&delta, data + i * width, width);
+    previous ^= delta << (shift * 8);
+    target[i] = previous;
+  }
+}
+// }}}
+
+query::DataPacket::Encoding packInts(const int32_t* values, int n,
+    string* target) {
+  const uint32_t* words = (const uint32_t*) values;
+  Statistics<uint32_t> statistics(words, n);
+  int32_t minimum = n > 0 ? values[0] : 0;
+  int32_t maximum = minimum;
+  for (int i = 1 ; i < n ; ++i) {
+    minimum = std::min(minimum, values[i]);
+    maximum = std::max(maximum, values[i]);
+  }
+  int width = bitsFor((uint32_t) maximum - (uint32_t) minimum);
+
+  size_t plain = n * sizeof(int32_t);
+  size_t frame = 5 + packedSize(n, width);
+  size_t runLength = statistics.runLengthSize();
+  size_t dictionary = statistics.dictionarySize(n);
+  size_t best = std::min(std::min(plain, frame),
+      std::min(runLength, dictionary));
+
+  if (best == plain) {
+    return query::DataPacket::PLAIN;
+  } else if (best == runLength) {
+    packRunLength(words, n, statistics.runs, target);
+    return query::DataPacket::RUN_LENGTH;
+  } else if (best == frame) {
+    packFrameOfReference(values, n, minimum, width, target);
+    return query::DataPacket::FRAME_OF_REFERENCE;
+  } else {
+    packDictionary(words, n, &statistics.dictionary, target);
+    return query::DataPacket::DICTIONARY;
+  }
+}
+
+query::DataPacket::Encoding packDoubles(const uint64_t* values, int n,
+    string* target) {
+  Statistics<uint64_t> statistics(values, n);
+  int shift, width;
+  xorDeltaBytes(values, n, &shift, &width);
+
+  size_t plain = n * sizeof(double);
+  size_t xorDelta = 2 + (size_t) n * width;
+  size_t runLength = statistics.runLengthSize();
+  size_t dictionary = statistics.dictionarySize(n);
+  size_t best = std::min(std::min(plain, xorDelta),
+      std::min(runLength, dictionary));
+
+  if (best == plain) {
+    return query::DataPacket::PLAIN;
+  } else if (best == runLength) {
+    packRunLength(values, n, statistics.runs, target);
+    return query::DataPacket::RUN_LENGTH;
+  } else if (best == dictionary) {
+    packDictionary(values, n, &statistics.dictionary, target);
+    return query::DataPacket::DICTIONARY;
+  } else {
+    packXorDelta(values, n, shift, width, target);
+    return query::DataPacket::XOR_DELTA;
+  }
+}
+
+}  // namespace
+
+query::DataPacket::Encoding packColumn(query::ColumnType type,
+    const char* data, int rows, string* target) {
+  switch (type) {
+    case query::INT:
+      return packInts((const int32_t*) data, rows, target);
+    case query::DOUBLE:
+      return packDoubles((const uint64_t*) data, rows, target);
+    case query::BOOL:
+      return query::DataPacket::PLAIN;
+    default:
+      assert(false);
+      return query::DataPacket::PLAIN;
+  }
+}
+
+void unpackColumn(query::ColumnType type,
+    query::DataPacket::Encoding encoding, const char* data, int rows,
+    char* target) {
+  const char* source = data;
+  switch (encoding) {
+    case query::DataPacket::PLAIN:
+      memcpy(target, source, plainSize(type, rows));
+      break;
+    case query::DataPacket::FRAME_OF_REFERENCE: {
+      assert(type == query::INT);
+      uint32_t minimum = read<int32_t>(source);
+      int width = read<uint8_t>(source);
+      unpackBits((const unsigned char*) source, rows, width, minimum,
+          (uint32_t*) target);
+      break;
+    }
+    case query::DataPacket::RUN_LENGTH:
+      if (type == query::INT) {
+        unpackRunLength(source, (uint32_t*) target);
+      } else {
+        unpackRunLength(source, (uint64_t*) target);
+      }
+      break;
+    case query::DataPacket::DICTIONARY:
+      if (type == query::INT) {
+        unpackDictionary(source, rows, (uint32_t*) target);
+      } else {
+        unpackDictionary(source, rows, (uint64_t*) target);
+      }
+      break;
+    case query::DataPacket::XOR_DELTA:
+      assert(type == query::DOUBLE);
+      unpackXorDelta(source, rows, (uint64_t*) target);
+      break;
+    default:
+      assert(false);
+  }
+}
@@ -0,0 +1,43 @@
+#ifndef DISTRIBUTED_ENCODING_H
+#define DISTRIBUTED_ENCODING_H
+
+#include <cassert>
+#include <string>
+
+#include "global.h"
+#include "proto/operations.pb.h"
+
+using std::string;
+
+/*
+ * Lightweight encodings of DataPacket columns. Layouts (little endian):
+ *  FRAME_OF_REFERENCE: int32 minimum, uint8 width, values minus the minimum
+ *    packed in width bits each
+ *  RUN_LENGTH: int32 runs, values of the runs, int32 lengths of the runs
+ *  DICTIONARY: int32 size, values, uint8 width, packed codes of the rows
+ *  XOR_DELTA: uint8 shift, uint8 width, each value XOR the previous one
+ *    shifted right by shift bytes and stored in width bytes
+ * Packed bits are followed by padding, so that they can be read by words.
+ */
+
+/**
+ * Appends rows values of a column to target, in the encoding estimated to be
+ * the smallest from one pass of statistics. Data is laid out as by
+ * Column::transfuse. Returns the encoding, for PLAIN nothing is appended
+ * as the data can be sent as it is.
+ */
+query::DataPacket::Encoding packColumn(query::ColumnType type,
+    const char* data, int rows, string* target);
+
+/** Bytes of rows values laid out as by transfuse, i.e. PLAIN encoded */
+inline size_t plainSize(query::ColumnType type, int rows) {
+  return type == query::BOOL ? (rows + 7) / 8 :
+    (size_t) rows * global::getTypeSize(type);
+}
+
+/** Decodes rows values packed by packColumn, laid out as by transfuse */
+void unpackColumn(query::ColumnType type,
+    query::DataPacket::Encoding encoding, const char* data, int rows,
+    char* target);
+
+#endif
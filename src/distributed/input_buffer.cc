@@ -2,7 +2,6 @@
 #include "communication.h"
 
 void InputBuffer::sendRequest(int provider_stripe, int number, int node) {
-  string msg;
   query::NetworkMessage com;
   com.data_request();
 
@@ -12,8 +11,7 @@ void InputBuffer::sendRequest(int provider_stripe, int number, int node) {
   request->set_consumer_stripe(*communication->stripe);
   request->set_number(number);
 
-  com.SerializeToString(&msg);
   communication->debugPrint("[SEND] Sending data request to %d msg={%s}", node,
       com.DebugString().c_str());
-  communication->nei->SendPacket(node, msg.c_str(), msg.size());
+  communication->sendMessage(node, com);
 }
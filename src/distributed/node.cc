@@ -5,6 +5,7 @@
 #include "node_environment/node_environment.h"
 #include "node.h"
 #include "operators/factory.h"
+#include "utils/buffer_pool.h"
 
 namespace global {
   WorkerNode* worker;
@@ -30,23 +31,25 @@ int WorkerNode::execPlan(query::Operation *op) {
           totalConsumeCount);
     }
   } else {
-    vector< vector<Column*> > *buckets;
+    const vector< vector<int> > *buckets;
+    vector<Column*> *columns;
     int buckets_num = 0;
     int totalPullCount = 0;
     int size;
     do {
       size = 0;
       // pull buckets
-      buckets = operation->bucketsPull();
+      columns = operation->bucketsPull(&buckets);
       if (buckets_num == 0) {
         // first iteration; we have to reset output buffer
         buckets_num = buckets->size();
-        communication.outputBuffer.resetOutput(buckets_num);
+        communication.outputBuffer.resetOutput(buckets_num,
+            operation->getTypes());
       }
 
       for (int i = 0; i < buckets_num; i++) {
-        size += (*buckets)[i][0]->size;
-        communication.outputBuffer.packData((*buckets)[i], i);
+        size += (*buckets)[i].size();
+        communication.outputBuffer.packData(*columns, (*buckets)[i], i);
       }
       totalPullCount += size;
       communication.debugPrint("[DATA] pulling %8d (total %8d)", size,
@@ -63,7 +66,7 @@ int WorkerNode::execPlan(query::Operation *op) {
 
       // add eof
       communication.debugPrint("[QUEUE] Add eof");
-      vector<Column*> noColumns;
+      vector<query::ColumnType> noColumns;
       communication.outputBuffer.output[i].push(new NodePacket(noColumns));
       communication.outputBuffer.output[i].back()->readyToSend = true;
       communication.outputBuffer.full_packets++;
@@ -79,6 +82,9 @@ int WorkerNode::execPlan(query::Operation *op) {
   }
 
   delete operation;
+  communication.debugPrint("[POOL] buffer pool hits %llu misses %llu",
+      (unsigned long long) util::BufferPool::Instance().hits(),
+      (unsigned long long) util::BufferPool::Instance().misses());
   return 0;
 }
 
@@ -89,6 +95,10 @@ void WorkerNode::run() {
     query::NetworkMessage::Stripe *st;
     st = communication.jobs.front();
     stripe = st->stripe();
+    if (st->has_chunk_size()) {
+      // before operators are created, packets of all stripes agree on it
+      global::setChunkSize(st->chunk_size());
+    }
     if (communication.delayed_requests.find(stripe) !=
         communication.delayed_requests.end()) {
       communication.requests = communication.delayed_requests[stripe];
@@ -1,7 +1,8 @@
 #include "output_buffer.h"
 #include "communication.h"
 
-void OutputBuffer::resetOutput(int buckets) {
+void OutputBuffer::resetOutput(int buckets,
+    const vector<query::ColumnType> &columnTypes) {
   for (uint32_t i = 0; i < output.size(); i++)
     if (output[i].size() != 0) assert(false); // calling during processing is forbidden
 
@@ -13,6 +14,7 @@ void OutputBuffer::resetOutput(int buckets) {
   output_counters.resize(buckets, 0);
   consumers_map.resize(0);
   consumers_map.resize(buckets, -1);
+  types = columnTypes;
   full_packets = 0;
 }
 
@@ -62,8 +64,9 @@ void OutputBuffer::parseRequests() {
   }
 }
 
-void OutputBuffer::packData(vector<Column*> &data, int bucket) {
-  /* Packs a given data into a given bucket. Then, parses *ALL* incoming
+void OutputBuffer::packData(const vector<Column*> &data,
+    const vector<int> &rows, int bucket) {
+  /* Packs given rows of data into a given bucket. Then, parses *ALL* incoming
    * requests and tries to satisfy them. Finally, tries to flush the
    * given bucket.
    *
@@ -81,8 +84,8 @@ void OutputBuffer::packData(vector<Column*> &data, int bucket) {
 
   communication->debugPrint("packData(%d)", bucket);
   if (buck.size() == 0 || buck.back()->readyToSend)
-    buck.push(new NodePacket(data));
-  buck.back()->consume(data);
+    buck.push(new NodePacket(types));
+  buck.back()->consume(data, rows);
 
   if (buck.back()->readyToSend)
     full_packets++;
@@ -90,8 +93,9 @@ void OutputBuffer::packData(vector<Column*> &data, int bucket) {
 
   // read all incoming requests
   query::NetworkMessage *message;
-  while ((message = communication->getMessage(false)) != NULL) {
-    communication->parseMessage(message, false); // we should have all data already
+  boost::shared_ptr<ReceivedPacket> packet;
+  while ((message = communication->getMessage(false, &packet)) != NULL) {
+    communication->parseMessage(message, false, packet); // we should have all data already
   }
 
   bool flag;
@@ -134,26 +138,25 @@ void OutputBuffer::flushBucket(int bucket) {
   query::DataPacket* packet;
   NodePacket* nodePacket;
   const google::protobuf::Reflection* r = response->data().GetReflection();
-  string msg;
+  PacketBuffers payload;
 
   response->set_node(communication->nei->my_node_number());
   response->set_stripe(*communication->stripe);
   // send data while we have a full packet and a pending request
   while (pending_requests[bucket] > 0 && output[bucket].front()->readyToSend) {
     nodePacket = output[bucket].front();
-    packet = nodePacket->serialize();
+    payload.clear();
+    packet = nodePacket->serialize(&payload);
     output_counters[bucket]++; // increase packet number counter
     if (nodePacket->isEOF()) {
       response->set_number(-1);
-      com.SerializeToString(&msg);
       communication->debugPrint("[SEND] sending EOF to %d", consumers_map[bucket]);
     } else {
       response->set_number(output_counters[bucket]); // set number
       r->Swap(response->mutable_data(), packet); // set data
-      com.SerializeToString(&msg);
       communication->debugPrint("[SEND] sending data response to %d", consumers_map[bucket]);
     }
-    communication->nei->SendPacket(consumers_map[bucket], msg.c_str(), msg.size()); // send
+    communication->sendMessage(consumers_map[bucket], com, payload); // send
 
     output[bucket].pop(); // remove packet from queue
     pending_requests[bucket]--;
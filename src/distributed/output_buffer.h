@@ -32,16 +32,19 @@ class OutputBuffer {
     vector<int> pending_requests;
     vector<int> output_counters;
     vector<int> consumers_map;
+    /** of the sent columns */
+    vector<query::ColumnType> types;
 
     /** Reads a data request from queue, tries to satisfy the consumer and
      *  schedule job for later if it's not possible. */
     void parseRequests();
-    /** Reset output buffer for a given number of buckets and a boolmask *
-     *  of sent columns.                                                 */
-    void resetOutput(int buckets);
-    /** Pack given data and eventually send to a consumer. Blocks if buffer is *
-      * full. */
-    void packData(vector<Column*> &data, int bucket);
+    /** Reset output buffer for a given number of buckets and types of *
+     *  sent columns.                                                    */
+    void resetOutput(int buckets, const vector<query::ColumnType> &types);
+    /** Pack given rows of data and eventually send to a consumer. Blocks *
+      * if buffer is full. */
+    void packData(const vector<Column*> &data, const vector<int> &rows,
+        int bucket);
 
     /** Tries to send accumulated data to a consumer */
     void flushBucket(int bucket);
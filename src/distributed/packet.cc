@@ -1,55 +1,79 @@
 #include "packet.h"
+#include "encoding.h"
+#include "communication.h"
+#include "utils/buffer_pool.h"
 
-NodePacket::NodePacket(vector<Column*> &view)
-  : size(0), readyToSend(false)
+namespace {
+
+const char padding[PACKET_ALIGNMENT] = { 0 };
+
+}  // namespace
+
+NodePacket::NodePacket(const vector<query::ColumnType> &types_)
+  : types(types_), size(0), readyToSend(false)
 {
   size_t row_size = 0;
-  columns.resize(view.size(), NULL);
-  offsets.resize(view.size(), 0);
-  types.resize(view.size(), query::INVALID_TYPE);
+  columns.resize(types.size(), NULL);
 
-  // collect row size and types
-  for (uint32_t i = 0; i < view.size(); i++) {
-    types[i] = view[i]->getType();
+  // collect row size
+  for (uint32_t i = 0; i < types.size(); i++) {
     row_size += global::getTypeSize(types[i]);
   }
 
-  if (view.empty()) {
+  if (types.empty()) {
     return; // it is eof packet
   }
 
   // compute maximum capacity
   capacity = MAX_PACKET_SIZE / row_size;
 
-  // allocate space and reset data counters;
-  for (uint32_t i = 0; i < view.size(); i++)
-    columns[i] = new char[capacity * global::getTypeSize(types[i])];
+  // allocate space
+  for (uint32_t i = 0; i < types.size(); i++)
+    columns[i] = static_cast<char*>(util::BufferPool::Instance().Allocate(
+          capacity * global::getTypeSize(types[i])));
 }
 
-/** Tries to consume a view. If it's too much data - returns false. */
-void NodePacket::consume(vector<Column*> view){
+void NodePacket::consume(const vector<Column*> &view,
+    const vector<int> &rows) {
   assert(!readyToSend); // should check if it's full before calling!
   assert(!isEOF());
+  assert(size + rows.size() <= capacity);
 
-  for (uint32_t i = 0; i < view.size(); i++)
-    offsets[i] += view[i]->transfuse(columns[i], offsets[i]);
-  size += static_cast<size_t>(view[0]->size);
+  if (!rows.empty()) {
+    for (uint32_t i = 0; i < view.size(); i++)
+      view[i]->transfuseRows(columns[i], size, &rows[0], rows.size());
+    size += rows.size();
+  }
 
-  if (capacity - size < static_cast<size_t>(DEFAULT_CHUNK_SIZE))
+  if (capacity - size < static_cast<size_t>(global::chunkSize))
     readyToSend = true;
 }
 
-query::DataPacket* NodePacket::serialize() {
+query::DataPacket* NodePacket::serialize(PacketBuffers* payload) {
   query::DataPacket *packet = new query::DataPacket();
 
+  packet->set_rows(size);
+  encoded.resize(types.size());
   for (uint32_t i = 0; i < types.size(); i++) {
+    query::DataPacket::Encoding encoding =
+      packColumn(types[i], columns[i], size, &encoded[i]);
+    const char* data = columns[i];
+    size_t bytes = plainSize(types[i], size);
+    if (encoding != query::DataPacket::PLAIN) {
+      data = encoded[i].data();
+      bytes = encoded[i].size();
+    }
     packet->add_type(types[i]);
-    packet->add_data(columns[i], offsets[i]);
+    packet->add_encoding(encoding);
+    packet->add_data_size(bytes);
+    payload->push_back(std::make_pair(data, bytes));
+    if (alignPacket(bytes) != bytes)
+      payload->push_back(std::make_pair(padding, alignPacket(bytes) - bytes));
   }
   return packet;
 }
 
 NodePacket::~NodePacket() {
   for(uint32_t i = 0; i < columns.size(); i++)
-    delete[] columns[i];
+    util::BufferPool::Instance().Release(columns[i]);
 }
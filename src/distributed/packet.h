@@ -5,35 +5,48 @@
 #include <queue>
 #include <map>
 #include <utility>
+#include <string>
 
 #include "global.h"
 #include "operators/operation.h"
 #include "operators/column.h"
 #include "proto/operations.pb.h"
 #include "node_environment/node_environment.h"
+#include "netio/packet_buffers.h"
 #include "distributed/packet.h"
 
 
 using std::vector;
+using std::string;
 
+/**
+ * Rows for one receiver, kept in column buffers laid out as sent, so the
+ * shuffle writes rows straight into the packet and the buffers are written
+ * to the socket as they are.
+ */
 class NodePacket {
   private:
     vector<char *> columns;
-    vector<uint32_t> offsets;
     vector<query::ColumnType> types;
+    vector<string> encoded; /** columns which aren't sent as they are */
     size_t size; /** size in rows */
     size_t capacity; /** maximum capacity in rows */
 
   public:
     bool readyToSend; /** only Packet should write to this! */
     // To create EOF past empty vector
-    NodePacket(vector<Column*> &view);
+    NodePacket(const vector<query::ColumnType> &types);
     bool isEOF() {
       return columns.empty();
     }
 
-    void consume(vector<Column*> view);
-    query::DataPacket* serialize();
+    /** Appends given rows of the columns */
+    void consume(const vector<Column*> &view, const vector<int> &rows);
+    /**
+     * Appends buffers of the columns to payload, see Communication. They
+     * are valid as long as the packet.
+     */
+    query::DataPacket* serialize(PacketBuffers* payload);
     virtual ~NodePacket();
 };
 
@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <cmath>
 #include <queue>
 
 #include "proto/operations.pb.h"
@@ -6,6 +8,13 @@
 
 #include "scheduler.h"
 
+vector<query::ColumnType> getColumnTypes(const query::Operation& opProto) {
+  Operation* op = Factory::createOperation(opProto);
+  vector<query::ColumnType> result = op->getTypes();
+  delete op;
+  return result;
+}
+
 /*
  * Cuts query into fragments.
  *
@@ -14,6 +23,9 @@
  *
  * Each fragment (apart from the first and the last ones) has union
  * operation as a source and shuffle operation as a sink.
+ * Group by is split into a partial group by that pre-aggregates rows
+ * before the shuffle and a final group by that sums partial aggregates
+ * (counts included) after the union.
  * Two consecutive fragments should have column fields matching in
  * shuffle and union operations (so they can be plugged together).
  *
@@ -68,36 +80,46 @@ vector<query::Operation> fragmentOperation(const query::Operation query) {
     fragmnets.pop_back();
     
     query::GroupByOperation groupBy = query.group_by();
-    
-    // columns needed by group by operations both for keys and values
-    vector<int> columns;
-    // columns used for hashing, subset of `columns`
-    vector<int> keyColumns;
-    // types of all columns of the source of group by
-    vector<query::ColumnType> types;
-    {
-      GroupByOperation* groupByOp = static_cast<GroupByOperation*>(Factory::createOperation(op));
-      columns = groupByOp->getUsedColumnsId();
-      keyColumns = groupByOp->getKeyColumnsId();
-      types = Factory::createOperation(groupBy.source())->getTypes();
-    }
+    int keysCount = groupBy.group_by_column_size();
+
+    // local pre-aggregation, it returns keys followed by partial aggregates
+    query::Operation partialOp;
+    query::GroupByOperation& partial = *partialOp.mutable_group_by();
+    partial.MergeFrom(groupBy);
+    partial.clear_source();
+    partial.mutable_source()->MergeFrom(lastFragment);
+    partial.set_partial(true);
+
+    // types of all columns returned by the pre-aggregation
+    vector<query::ColumnType> types = getColumnTypes(partialOp);
     
     query::Operation shuffle;
-    shuffle.mutable_shuffle()->mutable_source()->MergeFrom(lastFragment);
-    for (unsigned int i=0; i < columns.size(); i++) {
-      shuffle.mutable_shuffle()->add_column(columns[i]);
-      shuffle.mutable_shuffle()->add_type(types[columns[i]]);
+    shuffle.mutable_shuffle()->mutable_source()->MergeFrom(partialOp);
+    for (unsigned int i=0; i < types.size(); i++) {
+      shuffle.mutable_shuffle()->add_column(i);
+      shuffle.mutable_shuffle()->add_type(types[i]);
     }
-    for (unsigned int i = 0 ; i < keyColumns.size(); i++) {
-      shuffle.mutable_shuffle()->add_hash_column(keyColumns[i]);
+    for (int i = 0 ; i < keysCount; i++) {
+      shuffle.mutable_shuffle()->add_hash_column(i);
     }
     fragmnets.push_back(shuffle);
     
+    // final aggregation merges partial sums and counts
     groupBy.clear_source();
+    groupBy.clear_group_by_column();
+    groupBy.clear_aggregations();
     query::UnionOperation* union_ = groupBy.mutable_source()->mutable_union_();
-    for (unsigned i = 0; i < columns.size(); i++) {
-      union_->add_column(columns[i]);
-      union_->add_type(types[columns[i]]);
+    for (unsigned i = 0; i < types.size(); i++) {
+      union_->add_column(i);
+      union_->add_type(types[i]);
+    }
+    for (int i = 0; i < keysCount; i++) {
+      groupBy.add_group_by_column(i);
+    }
+    for (unsigned i = keysCount; i < types.size(); i++) {
+      query::Aggregation* aggregation = groupBy.add_aggregations();
+      aggregation->set_type(query::Aggregation::SUM);
+      aggregation->set_aggregated_column(i);
     }
     
     query::Operation groupByOp;
@@ -110,13 +132,6 @@ vector<query::Operation> fragmentOperation(const query::Operation query) {
   return fragmnets;
 }
 
-vector<query::ColumnType> getColumnTypes(const query::Operation& opProto) {
-  Operation* op = Factory::createOperation(opProto);
-  vector<query::ColumnType> result = op->getTypes();
-  delete op;
-  return result;
-}
-
 void addColumnsAndTypesToShuffle(query::ShuffleOperation& shuffle) {
   vector<query::ColumnType> types = getColumnTypes(shuffle.source());
   for (unsigned int i = 0; i < types.size(); i++) {
@@ -125,7 +140,228 @@ void addColumnsAndTypesToShuffle(query::ShuffleOperation& shuffle) {
   }
 }
 
+void markUsedColumns(const query::Expression& expression, vector<bool>* used) {
+  if (expression.operator_() == query::Expression::COLUMN) {
+    (*used)[expression.column_id()] = true;
+  }
+  for (int i = 0; i < expression.children_size(); i++) {
+    markUsedColumns(expression.children(i), used);
+  }
+}
+
+void remapColumns(query::Expression* expression, const vector<int>& mapping) {
+  if (expression->operator_() == query::Expression::COLUMN) {
+    assert(mapping[expression->column_id()] >= 0);
+    expression->set_column_id(mapping[expression->column_id()]);
+  }
+  for (int i = 0; i < expression->children_size(); i++) {
+    remapColumns(expression->mutable_children(i), mapping);
+  }
+}
+
+int expressionSize(const query::Expression& expression) {
+  int size = 1;
+  for (int i = 0; i < expression.children_size(); i++) {
+    size += expressionSize(expression.children(i));
+  }
+  return size;
+}
+
+/** Replaces every COLUMN i with a copy of columns[i] */
+void substituteColumns(query::Expression* expression,
+    const google::protobuf::RepeatedPtrField<query::Expression>& columns) {
+  if (expression->operator_() == query::Expression::COLUMN) {
+    expression->CopyFrom(columns.Get(expression->column_id()));
+    return;
+  }
+  for (int i = 0; i < expression->children_size(); i++) {
+    substituteColumns(expression->mutable_children(i), columns);
+  }
+}
+
+bool usesOnlyKeys(const query::Expression& expression, int keysCount) {
+  if (expression.operator_() == query::Expression::COLUMN &&
+      expression.column_id() >= keysCount) {
+    return false;
+  }
+  for (int i = 0; i < expression.children_size(); i++) {
+    if (!usesOnlyKeys(expression.children(i), keysCount)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/** Whether condition can be evaluated below query */
+bool filterSinks(const query::Operation& query,
+    const query::Expression& condition) {
+  if (query.has_compute()) {
+    return true;
+  } else if (query.has_group_by()) {
+    // rows of the groups dropped by a filter on keys
+    int keysCount = query.group_by().group_by_column_size();
+    return keysCount > 0 && usesOnlyKeys(condition, keysCount);
+  } else if (query.has_filter()) {
+    return filterSinks(query.filter().source(), condition);
+  }
+  return false;
+}
+
+/*
+ * Puts filter on condition over the query as deep as it gets:
+ * - below a compute, with the computed expressions substituted,
+ * - below a group by, if it uses key columns only,
+ * - below another filter, if it sinks further or is cheaper to evaluate
+ *   (in expression nodes), so the more expensive one sees less rows.
+ */
+query::Operation pushFilter(query::Operation query,
+    query::Expression condition) {
+  if (query.has_compute()) {
+    substituteColumns(&condition, query.compute().expressions());
+    query::Operation source = pushFilter(query.compute().source(), condition);
+    query.mutable_compute()->mutable_source()->Swap(&source);
+    return query;
+  }
+  if (query.has_group_by() && filterSinks(query, condition)) {
+    vector<int> keys(query.group_by().group_by_column().begin(),
+        query.group_by().group_by_column().end());
+    remapColumns(&condition, keys);
+    query::Operation source = pushFilter(query.group_by().source(), condition);
+    query.mutable_group_by()->mutable_source()->Swap(&source);
+    return query;
+  }
+  if (query.has_filter() && (filterSinks(query.filter().source(), condition) ||
+        expressionSize(condition) < expressionSize(query.filter().expression()))) {
+    query::Operation source = pushFilter(query.filter().source(), condition);
+    query.mutable_filter()->mutable_source()->Swap(&source);
+    return query;
+  }
+  query::Operation filter;
+  filter.mutable_filter()->mutable_source()->Swap(&query);
+  filter.mutable_filter()->mutable_expression()->Swap(&condition);
+  return filter;
+}
+
+/*
+ * Rewrites the query so that filters run as early as possible, see
+ * pushFilter. Filters pushed below a group by end up in the first fragment,
+ * ahead of the shuffle, so less rows are computed, aggregated and sent.
+ */
+query::Operation pushDownFilters(query::Operation query) {
+  if (query.has_compute()) {
+    query::Operation source = pushDownFilters(query.compute().source());
+    query.mutable_compute()->mutable_source()->Swap(&source);
+  } else if (query.has_group_by()) {
+    query::Operation source = pushDownFilters(query.group_by().source());
+    query.mutable_group_by()->mutable_source()->Swap(&source);
+  } else if (query.has_filter()) {
+    return pushFilter(pushDownFilters(query.filter().source()),
+        query.filter().expression());
+  }
+  return query;
+}
+
+/*
+ * Drops columns of the query that aren't used by anyone: scanned columns,
+ * compute expressions and aggregations. `live` tells which columns of the
+ * query result are used, at least one column is always kept so that rows
+ * can still be counted.
+ *
+ * Returns new ids of the result columns, -1 for dropped ones.
+ *
+ * It runs before fragmentOperation, so shuffles and unions introduced there
+ * carry only live columns.
+ */
+vector<int> pruneColumns(query::Operation* query, vector<bool> live) {
+  vector<int> mapping(live.size(), -1);
+  if (std::find(live.begin(), live.end(), true) == live.end() &&
+      !live.empty()) {
+    live[0] = true;
+  }
+
+  if (query->has_scan()) {
+    query::ScanOperation& scan = *query->mutable_scan();
+    query::ScanOperation pruned;
+    pruned.set_number_of_files(scan.number_of_files());
+    for (int i = 0; i < scan.column_size(); i++) {
+      if (live[i]) {
+        mapping[i] = pruned.column_size();
+        pruned.add_column(scan.column(i));
+        pruned.add_type(scan.type(i));
+      }
+    }
+    scan.Swap(&pruned);
+  } else if (query->has_compute()) {
+    query::ComputeOperation& compute = *query->mutable_compute();
+    query::ComputeOperation pruned;
+    vector<bool> used(getColumnTypes(compute.source()).size(), false);
+    for (int i = 0; i < compute.expressions_size(); i++) {
+      if (live[i]) {
+        mapping[i] = pruned.expressions_size();
+        pruned.add_expressions()->Swap(compute.mutable_expressions(i));
+        markUsedColumns(pruned.expressions(mapping[i]), &used);
+      }
+    }
+    vector<int> sourceMapping = pruneColumns(compute.mutable_source(), used);
+    for (int i = 0; i < pruned.expressions_size(); i++) {
+      remapColumns(pruned.mutable_expressions(i), sourceMapping);
+    }
+    compute.mutable_expressions()->Swap(pruned.mutable_expressions());
+  } else if (query->has_filter()) {
+    // filter returns columns of its source, the condition uses some more
+    query::FilterOperation& filter = *query->mutable_filter();
+    vector<bool> used = live;
+    markUsedColumns(filter.expression(), &used);
+    vector<int> sourceMapping = pruneColumns(filter.mutable_source(), used);
+    remapColumns(filter.mutable_expression(), sourceMapping);
+    for (unsigned i = 0; i < live.size(); i++) {
+      mapping[i] = live[i] ? sourceMapping[i] : -1;
+    }
+  } else if (query->has_group_by()) {
+    // keys are always kept, they make the groups
+    query::GroupByOperation& groupBy = *query->mutable_group_by();
+    int keysCount = groupBy.group_by_column_size();
+    vector<bool> used(getColumnTypes(groupBy.source()).size(), false);
+    for (int i = 0; i < keysCount; i++) {
+      mapping[i] = i;
+      used[groupBy.group_by_column(i)] = true;
+    }
+    google::protobuf::RepeatedPtrField<query::Aggregation> aggregations;
+    for (int i = 0; i < groupBy.aggregations_size(); i++) {
+      if (live[keysCount + i]) {
+        mapping[keysCount + i] = keysCount + aggregations.size();
+        aggregations.Add()->Swap(groupBy.mutable_aggregations(i));
+      }
+    }
+    for (int i = 0; i < aggregations.size(); i++) {
+      if (aggregations.Get(i).has_aggregated_column()) {
+        used[aggregations.Get(i).aggregated_column()] = true;
+      }
+    }
+    vector<int> sourceMapping = pruneColumns(groupBy.mutable_source(), used);
+    for (int i = 0; i < keysCount; i++) {
+      groupBy.set_group_by_column(i,
+          sourceMapping[groupBy.group_by_column(i)]);
+    }
+    for (int i = 0; i < aggregations.size(); i++) {
+      query::Aggregation& aggregation = *aggregations.Mutable(i);
+      if (aggregation.has_aggregated_column()) {
+        aggregation.set_aggregated_column(
+            sourceMapping[aggregation.aggregated_column()]);
+      }
+    }
+    groupBy.mutable_aggregations()->Swap(&aggregations);
+  } else {
+    // scan_file, union, shuffle and final are introduced later
+    assert(false);
+  }
+  return mapping;
+}
+
 vector<query::Operation>* SchedulerNode::makeFragments(query::Operation query) {
+  query = pushDownFilters(query);
+  // the whole result is sent to the sink
+  pruneColumns(&query, vector<bool>(getColumnTypes(query).size(), true));
   vector<query::Operation> fragments = fragmentOperation(query);
   // add shuffle to the last but one fragment
   {
@@ -187,6 +423,46 @@ void assignNodesToUnion(query::Operation& stripe, const vector< std::pair<int, i
   }
 }
 
+/*
+ * Replaces the union in the stripe by the given operation. Returns false if
+ * there is no union.
+ *
+ * This method mutates passed stripe.
+ */
+bool replaceUnion(query::Operation* stripe, const query::Operation& source) {
+  if (stripe->has_compute()) {
+    return replaceUnion(stripe->mutable_compute()->mutable_source(), source);
+  } else if (stripe->has_filter()) {
+    return replaceUnion(stripe->mutable_filter()->mutable_source(), source);
+  } else if (stripe->has_group_by()) {
+    return replaceUnion(stripe->mutable_group_by()->mutable_source(), source);
+  } else if (stripe->has_shuffle()) {
+    return replaceUnion(stripe->mutable_shuffle()->mutable_source(), source);
+  } else if (stripe->has_final()) {
+    return replaceUnion(stripe->mutable_final()->mutable_source(), source);
+  } else if (stripe->has_union_()) {
+    stripe->CopyFrom(source);
+    return true;
+  }
+  return false;
+}
+
+/*
+ * Merges leading fragments until `count` are left. A union reading from
+ * the previous fragment is replaced by what that fragment shuffles, both
+ * return the same columns. Partial group bys are then followed by their
+ * final ones directly.
+ */
+void mergeFragments(vector<query::Operation>* fragments, unsigned count) {
+  while (fragments->size() > count) {
+    assert((*fragments)[0].has_shuffle());
+    query::Operation source = (*fragments)[0].shuffle().source();
+    bool replaced = replaceUnion(&(*fragments)[1], source);
+    assert(replaced);
+    fragments->erase(fragments->begin());
+  }
+}
+
 void assignReceiversCount(query::Operation& stripe, int receiversCount) {
   // the last operation (the root of stripe) should be shuffle
   assert(stripe.has_shuffle());
@@ -248,43 +524,134 @@ void assignFileToScan(query::Operation& stripe, int fileToScan) {
   }
 }
 
+/*
+ * Estimated work of a fragment in units of a scanned column value, rows of
+ * one input file being a unit of rows. `rows` are the rows read by the
+ * fragment's union (files for the first one), they are set to the rows
+ * the fragment returns.
+ */
+double estimateCost(const query::Operation& op, double* rows) {
+  if (op.has_scan_file()) {
+    return *rows * op.scan_file().column_size() * COST_SCAN;
+  } else if (op.has_union_()) {
+    return *rows * op.union_().column_size() * COST_SHIP;
+  } else if (op.has_compute()) {
+    double cost = estimateCost(op.compute().source(), rows);
+    for (int i = 0; i < op.compute().expressions_size(); i++) {
+      cost += *rows * expressionSize(op.compute().expressions(i)) *
+        COST_COMPUTE;
+    }
+    return cost;
+  } else if (op.has_filter()) {
+    double cost = estimateCost(op.filter().source(), rows);
+    cost += *rows * expressionSize(op.filter().expression()) * COST_COMPUTE;
+    *rows *= ESTIMATED_FILTER_SELECTIVITY;
+    return cost;
+  } else if (op.has_group_by()) {
+    const query::GroupByOperation& groupBy = op.group_by();
+    double cost = estimateCost(groupBy.source(), rows);
+    cost += *rows * COST_GROUP_BY *
+      (groupBy.group_by_column_size() + groupBy.aggregations_size());
+    *rows *= ESTIMATED_GROUP_BY_REDUCTION;
+    return cost;
+  } else if (op.has_shuffle()) {
+    double cost = estimateCost(op.shuffle().source(), rows);
+    return cost + *rows * op.shuffle().column_size() * COST_SHIP;
+  } else if (op.has_final()) {
+    return estimateCost(op.final().source(), rows);
+  }
+  // unknown operations cost as much as reading their input
+  return *rows * COST_SCAN;
+}
+
+/*
+ * A stripe finishes only once all its output is sent, so neighbouring
+ * fragments can't share nodes (the consumer would wait for the producer
+ * queued before it on the same node). Workers are split into two groups,
+ * fragments alternate between them, and the split balances the estimated
+ * cost of the groups.
+ *
+ * node[0] is the scheduler and node[1] runs the final operation. Before
+ * it, node[1] runs stripes of the group not adjacent to the final fragment,
+ * unless that group reads input files (sources of the data server write
+ * to the results file as well).
+ *
+ * The first fragment has a stripe per node of its group (no more than
+ * files), its scans ask for input files one by one as they finish the
+ * previous ones, see serveFiles, so faster nodes read more of them. Inner
+ * fragments get a stripe per cost of reading a file, at most a stripe per
+ * node of the group, so that little data isn't scattered into tiny packets.
+ *
+ * With too few workers for two groups the fragments are merged, so that
+ * all stages before the final one run together on the workers there are,
+ * or, with no workers at all, the whole query runs on node[1].
+ */
 void SchedulerNode::schedule(vector<query::Operation> *fragments, uint32_t nodes, int numberOfFiles) {
-  // we reserve two nodes:
-  // node[0]: scheduler
-  // node[1]: final operation
-  int nodesPerStripe = -1;
-  if (fragments->size() == 2) {
-    // if we have only two fragments then it means there's only fragment for
-    // input files and union, we should assign all workers (apart from two)
-    // to the first fragment
-    nodesPerStripe = nodes - 2;
-  } else {
-    // nodesPerStripe is half rounded up
-    nodesPerStripe = (nodes - 2 + 1) / 2;
+  int last = fragments->size() - 1;
+  if (last == 0) {
+    scanStripes = 1;
+    query::Operation stripe = fragments->back();
+    assignFileToScan(stripe, ASK_FOR_FILES);
+    communication.debugPrint("Fragment 0: the whole query on node 1");
+    sendJob(stripe, 1, 0);
+    return;
   }
-  // we don't handle situation when we have one worker only
-  assert(nodesPerStripe > 0);
-  // we divide workers into two groups that will be used for two consecutive layers of stripes
-  vector<int> nodeIds;
-  vector<int> nodeIdsNext;
-  for (int i = 2; i < 2 + nodesPerStripe; i++) {
-    nodeIds.push_back(i);
+  vector<double> costs(fragments->size());
+  double rows = numberOfFiles;
+  for (int i = 0; i <= last; i++) {
+    costs[i] = estimateCost((*fragments)[i], &rows);
   }
-  for (uint32_t i = 2 + nodesPerStripe; i < nodes; i++) {
-    nodeIdsNext.push_back(i);
+  double groupCost[2] = {0, 0};
+  for (int i = 0; i < last; i++) {
+    groupCost[i % 2] += costs[i];
   }
-  
-  //printf("nodeIds: ");
-  for (unsigned int i = 0; i < nodeIds.size(); i++) {
-    //printf("%d, ", nodeIds[i]);
+
+  int workers = nodes - 2;
+  bool finalNodeWorks = last >= 3 && last % 2 == 1;
+  int firstGroupWorkers = -1;
+  double bestTime = 0;
+  for (int k = 0; k <= workers; k++) {
+    int size[2] = {k, workers - k};
+    if (finalNodeWorks) {
+      size[last % 2]++;
+    }
+    if (size[0] == 0 || (last >= 2 && size[1] == 0)) {
+      continue;
+    }
+    double time = std::max(groupCost[0] / size[0],
+        size[1] > 0 ? groupCost[1] / size[1] : 0.);
+    if (firstGroupWorkers == -1 || time < bestTime) {
+      firstGroupWorkers = k;
+      bestTime = time;
+    }
   }
-  //printf("\n");
-  //printf("nodeIdsNext: ");
-  for (unsigned int i = 0; i < nodeIdsNext.size(); i++) {
-    //printf("%d, ", nodeIdsNext[i]);
+  if (firstGroupWorkers < 0) {
+    mergeFragments(fragments, workers > 0 ? 2 : 1);
+    schedule(fragments, nodes, numberOfFiles);
+    return;
   }
-  //printf("\n");
-  
+  vector<int> groups[2];
+  for (int i = 0; i < workers; i++) {
+    groups[i < firstGroupWorkers ? 0 : 1].push_back(2 + i);
+  }
+  if (finalNodeWorks) {
+    groups[last % 2].push_back(1);
+  }
+
+  vector<int> stripesCount(fragments->size(), 1);
+  stripesCount[0] = std::min(numberOfFiles, (int) groups[0].size());
+  scanStripes = stripesCount[0];
+  double stripeCost = costs[0] / numberOfFiles;
+  for (int i = 1; i < last; i++) {
+    int wanted = std::max(1, (int) ceil(costs[i] / stripeCost));
+    stripesCount[i] = std::min(wanted, (int) groups[i % 2].size());
+  }
+  for (int i = 0; i <= last; i++) {
+    communication.debugPrint("Fragment %d: cost %.2f, %d stripes on %d nodes",
+        i, costs[i], i < last ? stripesCount[i] : 1,
+        i < last ? (int) groups[i % 2].size() : 1);
+  }
+
   vector< std::pair<int, int> > previousStripeIds;
   int stripeId = 0;
   /* Stripes from the previous query fragment compared to
@@ -301,41 +668,23 @@ void SchedulerNode::schedule(vector<query::Operation> *fragments, uint32_t nodes
    *    jobs to workers
    */
   vector<query::Operation> previousStripes;
-  // process the first fragment
-  {
-    query::Operation& firstStripe = fragments->front();
-    // TODO: special hack for case of only two stripes, I need to refactor this
-    // code to handle it in more elegant way
-    if (fragments->size() == 2) {
-      assignReceiversCount(firstStripe, 1);
-    } else {
-      assignReceiversCount(firstStripe, nodeIdsNext.size());
-    }
-    for (int i = 0; i < numberOfFiles; i++) {
-      query::Operation stripeForFile = firstStripe; // make copy
-      assignFileToScan(stripeForFile, i);
-      int nodeId = nodeIds[i%nodeIds.size()];
-      previousStripes.push_back(stripeForFile);
-      previousStripeIds.push_back(std::make_pair(nodeId, stripeId));
-      stripeId++;
+  for (int i = 0; i < last; i++) {
+    query::Operation& fragment = (*fragments)[i];
+    const vector<int>& group = groups[i % 2];
+    if (i > 0) {
+      // assign to union nodes and stripes of the previous fragment
+      assignNodesToUnion(fragment, previousStripeIds);
     }
-  }
-  std::swap(nodeIds, nodeIdsNext);
-  // process inner fragments
-  for (unsigned i = 1; i + 1 < fragments->size(); i++) {
-    query::Operation& stripe = (*fragments)[i];
     vector< std::pair<int, int> > stripeIds;
     vector<query::Operation> currentStripes;
-    // assign to union nodes and stripes that were
-    // sent in the previous iteration
-    assignNodesToUnion(stripe, previousStripeIds);
-    assignReceiversCount(stripe, nodeIdsNext.size());
-    for (unsigned int j = 0; j < nodeIds.size(); j++) {
-      int nodeId = nodeIds[j%nodeIds.size()];
+    for (int j = 0; j < stripesCount[i]; j++) {
       // make local copy of stripe because sendJob destroys its input data
-      query::Operation localStripe = stripe;
+      query::Operation localStripe = fragment;
+      if (i == 0) {
+        assignFileToScan(localStripe, ASK_FOR_FILES);
+      }
       currentStripes.push_back(localStripe);
-      stripeIds.push_back(std::make_pair(nodeId, stripeId));
+      stripeIds.push_back(std::make_pair(group[j % group.size()], stripeId));
       stripeId++;
     }
     for (unsigned j = 0; j < previousStripes.size(); j++) {
@@ -345,7 +694,6 @@ void SchedulerNode::schedule(vector<query::Operation> *fragments, uint32_t nodes
     }
     previousStripeIds = stripeIds;
     previousStripes = currentStripes;
-    std::swap(nodeIds, nodeIdsNext);
   }
   // schedule the last fragment, use worker[1]
   {
@@ -360,6 +708,28 @@ void SchedulerNode::schedule(vector<query::Operation> *fragments, uint32_t nodes
   }
 }
 
+void SchedulerNode::serveFiles(int numberOfFiles) {
+  int nextFile = 0;
+  int finishedScans = 0;
+  // every scan asks until it's answered there are no more files
+  while (finishedScans < scanStripes) {
+    communication.getFileRequest();
+    query::FileRequest* request = communication.fileRequests.front();
+    communication.fileRequests.pop();
+    query::NetworkMessage com;
+    if (nextFile < numberOfFiles) {
+      com.mutable_file_assignment()->set_file(nextFile++);
+    } else {
+      com.mutable_file_assignment()->set_file(-1);
+      finishedScans++;
+    }
+    communication.debugPrint("Assigning file %d to worker[%d]",
+        com.file_assignment().file(), request->node());
+    communication.sendMessage(request->node(), com);
+    delete request;
+  }
+}
+
 void SchedulerNode::sendJob(query::Operation &op, uint32_t node, int stripeId) {
   //printf("Enqueing stripe[%d] to worker[%d]\n\n", stripeId, node);
   nodesJobs[node].push_back(std::make_pair(stripeId, op));
@@ -367,7 +737,6 @@ void SchedulerNode::sendJob(query::Operation &op, uint32_t node, int stripeId) {
 
 void SchedulerNode::flushJobs() {
   const google::protobuf::Reflection *r;
-  string msg;
   
   for (uint32_t node = 0; node < nodesJobs.size(); node++) {
     if (nodesJobs[node].size() == 0)
@@ -377,13 +746,13 @@ void SchedulerNode::flushJobs() {
     for (uint32_t i = 0; i < nodesJobs[node].size(); i++) {
       com.add_stripe();
       com.mutable_stripe(i)->set_stripe(nodesJobs[node][i].first);
+      com.mutable_stripe(i)->set_chunk_size(global::chunkSize);
       r = com.stripe(i).operation().GetReflection();
       r->Swap(&nodesJobs[node][i].second, com.mutable_stripe(i)->mutable_operation());
     }
     
-    com.SerializeToString(&msg);
     //printf("Sending jobs to worker[%d]\n\n%s", node, com.DebugString().c_str());
-    communication.nei->SendPacket(node, msg.c_str(), msg.size());
+    communication.sendMessage(node, com);
   }
 }
 
@@ -401,6 +770,7 @@ void SchedulerNode::run(const query::Operation &op) {
   schedule(fragments, communication.nei->nodes_count(), numberOfInputFiles);
   flushJobs();
   delete fragments;
+  serveFiles(numberOfInputFiles);
   
   // TODO : switch to a worker mode
   // execPlan(finalOperation);
@@ -13,10 +13,22 @@
 using std::vector;
 using std::pair;
 
+/** Types of the columns the query returns */
+vector<query::ColumnType> getColumnTypes(const query::Operation& opProto);
+/** Moves filters of the query as deep as they get, see pushFilter */
+query::Operation pushDownFilters(query::Operation query);
+/**
+ * Drops columns of the query nobody uses, live tells which result columns
+ * are. Returns new ids of the result columns, -1 for dropped ones.
+ */
+vector<int> pruneColumns(query::Operation* query, vector<bool> live);
+
 class SchedulerNode : public WorkerNode {
   private:
     SchedulerNode(const SchedulerNode &node);
     vector< vector< pair<int, query::Operation> > > nodesJobs;
+    /** Stripes of the first fragment, they ask for input files */
+    int scanStripes;
 
   protected:
     /** Slice query into fragments */
@@ -27,9 +39,11 @@ class SchedulerNode : public WorkerNode {
     void sendJob(query::Operation &op, uint32_t node, int stripeId);
     /** Send all jobs to nodes */
     void flushJobs();
+    /** Answer file requests of scans until each of them got all files */
+    void serveFiles(int numberOfFiles);
 
    public:
-    SchedulerNode(NodeEnvironmentInterface *nei) : WorkerNode(nei) {
+    SchedulerNode(NodeEnvironmentInterface *nei) : WorkerNode(nei), scanStripes(0) {
       nodesJobs.resize(nei->nodes_count());
     };
 
@@ -0,0 +1,98 @@
+// Fast And Furious column database
+// Author: Jacek Migdal <jacek@migdal.pl>
+//
+// Compares the generated switch from operators/filter.h with the kernels
+// from operators/compaction.h on random bitmaps of several selectivities.
+// Usage: ./filter_bench [chunks]
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <time.h>
+
+#include "operators/filter.h"
+#include "operators/compaction.h"
+
+using std::vector;
+
+const int CHUNK = 512; // DEFAULT_CHUNK_SIZE
+
+static double now() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/** Compacts with the generated switch, a bitmap byte at a time */
+template<class T>
+static int filterSwitch(T* source, unsigned char* bitmap, T* target) {
+  int rest = 0;
+  for (int i = 0 ; i < CHUNK ; i += 8) {
+    rest += filterPrimitive(target, source + i, bitmap[i / 8], rest);
+  }
+  return rest;
+}
+
+/** Selects rows with a kernel and gathers them */
+template<class T>
+static int filterKernel(SelectRowsKernel kernel, T* source,
+    unsigned char* bitmap, int* rows, T* target) {
+  int n = kernel(bitmap, CHUNK, rows);
+  for (int i = 0 ; i < n ; ++i) {
+    target[i] = source[rows[i]];
+  }
+  return n;
+}
+
+template<class T>
+static void bench(const char* type, int chunks, double selectivity) {
+  vector<T> source(CHUNK * chunks);
+  vector<unsigned char> bitmaps(CHUNK / 8 * chunks, 0);
+  for (unsigned i = 0 ; i < source.size() ; ++i) {
+    source[i] = (T) i;
+    if (rand() < selectivity * RAND_MAX) {
+      bitmaps[i / 8] |= 1 << (i & 7);
+    }
+  }
+  vector<T> target(CHUNK + 8);
+  vector<int> rows(CHUNK + 8);
+
+  long long expected = 0;
+  double start = now();
+  for (int c = 0 ; c < chunks ; ++c) {
+    expected += filterSwitch(&source[c * CHUNK], &bitmaps[c * CHUNK / 8],
+        &target[0]);
+  }
+  double base = now() - start;
+  printf("%-6s %5.1f%%  switch %7.2f ns/row\n", type, selectivity * 100,
+      base * 1e9 / source.size());
+
+  int count;
+  const SelectRowsVariant* variants = selectRowsVariants(&count);
+  for (int v = 0 ; v < count ; ++v) {
+    if (!variants[v].supported) {
+      continue;
+    }
+    long long selected = 0;
+    start = now();
+    for (int c = 0 ; c < chunks ; ++c) {
+      selected += filterKernel(variants[v].kernel, &source[c * CHUNK],
+          &bitmaps[c * CHUNK / 8], &rows[0], &target[0]);
+    }
+    double time = now() - start;
+    printf("%-6s %5.1f%%  %-6s %7.2f ns/row  x%.2f%s\n", type,
+        selectivity * 100, variants[v].name, time * 1e9 / source.size(),
+        base / time, selected == expected ? "" : "  WRONG");
+  }
+}
+
+int main(int argc, char** argv) {
+  int chunks = argc > 1 ? atoi(argv[1]) : 20000;
+  double selectivities[] = { 0.01, 0.1, 0.5, 0.9, 1.0 };
+  printf("default kernel: %s\n", selectRowsName());
+  for (unsigned i = 0 ; i < sizeof(selectivities) / sizeof(double) ; ++i) {
+    bench<int>("int", chunks, selectivities[i]);
+    bench<double>("double", chunks, selectivities[i]);
+  }
+  return 0;
+}
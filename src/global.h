@@ -9,16 +9,62 @@
 
 #ifndef TEST_FLAG
 const int DEFAULT_CHUNK_SIZE = 512; // in rows
+const int MAX_CHUNK_SIZE = 4096; // in rows, bound of global::chunkSize
 const int MAX_PACKET_SIZE = 1000 * 1024; // (in bytes) TODO : find a good value
 const int MAX_OUTPUT_PACKETS = 100; // in packets
+const int PARTIAL_GROUP_BY_SAMPLE = 64 * 1024; // in rows
+const int PARTIAL_GROUP_BY_MAX_GROUPS = 1024 * 1024; // flush table above
+const size_t DEFAULT_GROUP_BY_MEMORY_LIMIT = 512 * 1024 * 1024; // in bytes
+const int GROUP_BY_SPILL_PARTITIONS = 32;
+const size_t GROUP_BY_ARENA_BLOCK = 1024 * 1024; // in bytes
 #else
 const int DEFAULT_CHUNK_SIZE = 5;
+const int MAX_CHUNK_SIZE = 5;
 const int MAX_PACKET_SIZE = 100;
 const int MAX_OUTPUT_PACKETS = 15;
+const int PARTIAL_GROUP_BY_SAMPLE = 20;
+const int PARTIAL_GROUP_BY_MAX_GROUPS = 10;
+const size_t DEFAULT_GROUP_BY_MEMORY_LIMIT = 32 * 1024;
+const int GROUP_BY_SPILL_PARTITIONS = 4;
+const size_t GROUP_BY_ARENA_BLOCK = 4 * 1024;
 #endif
+// partial group by passes rows through if it has more groups per input row
+const double PARTIAL_GROUP_BY_MAX_RATIO = 0.5;
+// filters merge chunks with fewer selected rows of global::chunkSize
+const double COALESCE_FILL_RATIO = 0.5;
+// chunks with at most that many runs or distinct values get encoded
+const int ENCODING_MAX_VALUES = 16;
+// scheduler cost model, relative to scanning a column value
+const double COST_SCAN = 1.0;
+const double COST_COMPUTE = 0.25; // per expression node
+const double COST_GROUP_BY = 2.0; // per key and aggregation
+const double COST_SHIP = 2.0; // to send or to receive
+const double ESTIMATED_FILTER_SELECTIVITY = 0.5;
+const double ESTIMATED_GROUP_BY_REDUCTION = 0.1;
 
 namespace global {
 
+/**
+ * Rows of chunks, DEFAULT_CHUNK_SIZE unless set by setChunkSize before
+ * operators are created. Fixed size arrays use MAX_CHUNK_SIZE.
+ */
+extern int chunkSize;
+
+/**
+ * Bytes of a group by table above which it spills to disk,
+ * DEFAULT_GROUP_BY_MEMORY_LIMIT unless set before queries run.
+ */
+extern size_t groupByMemoryLimit;
+
+/** Rounded up to a whole bitmap byte, at most MAX_CHUNK_SIZE */
+inline void setChunkSize(int rows) {
+  rows = (rows + 7) / 8 * 8;
+  chunkSize = rows < 8 ? 8 : rows;
+  if (chunkSize > MAX_CHUNK_SIZE) {
+    chunkSize = MAX_CHUNK_SIZE;
+  }
+}
+
 template<class T>
 inline query::ColumnType getType() {
   return query::INVALID_TYPE;
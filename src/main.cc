@@ -7,6 +7,8 @@
 #include <boost/program_options.hpp>
 #include <fstream>
 #include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
 #include <google/protobuf/text_format.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 
@@ -15,6 +17,7 @@ using google::protobuf::io::FileInputStream;
 
 #include "operators/factory.h"
 #include "operators/operation.h"
+#include "distributed/scheduler.h"
 
 #include "proto/operations.pb.h"
 
@@ -32,13 +35,48 @@ int runQuery(const string server, int queryId, Operation* operation) {
   return 0;
 }
 
+double now() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/** Runs the query with chunk sizes from 64 rows up, reports the fastest */
+int sweepChunkSizes(const string server, int queryId,
+    const query::Operation& rootOperation) {
+  int best = 0;
+  double bestTime = 0;
+  for (int rows = 64 ; rows <= MAX_CHUNK_SIZE ; rows *= 2) {
+    global::setChunkSize(rows);
+    srand(queryId); // the same data for every size
+    Factory::server = CreateServer(queryId, server);
+    Operation* operation = Factory::createOperation(rootOperation);
+    double start = now();
+    while (operation->consume() > 0) {
+    }
+    double time = now() - start;
+    delete operation;
+    delete Factory::server;
+    fprintf(stderr, "chunk size %5d: %.3f s\n", global::chunkSize, time);
+    if (best == 0 || time < bestTime) {
+      best = global::chunkSize;
+      bestTime = time;
+    }
+  }
+  fprintf(stderr, "best chunk size: %d\n", best);
+  return 0;
+}
+
 int main(int args, char** argv) {
   po::options_description desc("Allowed options");
   string server;
+  int chunkSize;
   desc.add_options()
       ("help", "produce help message")
       ("tree", "display query tree instead of running it")
       ("server", po::value<string>(&server)->default_value("default"), "choose server you want: test, default, perf")
+      ("chunk-size", po::value<int>(&chunkSize)->default_value(DEFAULT_CHUNK_SIZE), "rows of column chunks")
+      ("sweep-chunk-sizes", "run the query with various chunk sizes and report the fastest")
   ;
 
   po::options_description hidden("Hidden options");
@@ -70,7 +108,16 @@ int main(int args, char** argv) {
   query::Operation rootOperation;
   TextFormat::Parse(&queryFile, &rootOperation);
   queryFile.Close();
+  // the same rewrites as the scheduler does before slicing the query
+  rootOperation = pushDownFilters(rootOperation);
+  pruneColumns(&rootOperation,
+      vector<bool>(getColumnTypes(rootOperation).size(), true));
+
+  if (vm.count("sweep-chunk-sizes")) {
+    return sweepChunkSizes(server, queryNum, rootOperation);
+  }
 
+  global::setChunkSize(chunkSize);
   Operation* operation = Factory::createOperation(rootOperation);
 
   if (vm.count("tree")) {
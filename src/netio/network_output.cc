@@ -75,3 +75,35 @@ bool NetworkOutput::SendPacket(const char* data, std::size_t data_len) {
   }
   return false;
 }
+
+bool NetworkOutput::SendPacket(const PacketBuffers& buffers) {
+  boost::mutex::scoped_lock lock(mutex_);
+  try {
+    if (!EnsureConnectionExists()) return false;
+    if (socket_.is_open()) {
+      std::size_t data_len = 0;
+      for (std::size_t i = 0; i < buffers.size(); i++) {
+        data_len += buffers[i].second;
+      }
+      uint32_t net_buffer_length = htonl(data_len);
+      std::vector<boost::asio::const_buffer> parts;
+      parts.reserve(buffers.size() + 1);
+      parts.push_back(boost::asio::buffer(&net_buffer_length,
+                                          sizeof(net_buffer_length)));
+      for (std::size_t i = 0; i < buffers.size(); i++) {
+        parts.push_back(boost::asio::buffer(buffers[i].first,
+                                            buffers[i].second));
+      }
+      CHECK(boost::asio::write(socket_, parts)
+            == sizeof(net_buffer_length) + data_len,
+            "Write failed");
+      return true;
+    } else {
+      LOG2("%s:%s Cannot connect", host_.c_str(), service_.c_str());
+      return false;
+    };
+  } catch(...) {
+    LOG2("%s:%s Exception.", host_.c_str(), service_.c_str());
+  }
+  return false;
+}
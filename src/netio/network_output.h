@@ -12,6 +12,8 @@
 #include <boost/asio.hpp>
 #include <boost/thread/mutex.hpp>
 
+#include "netio/packet_buffers.h"
+
 // The class is thread safe.
 class NetworkOutput {
  public:
@@ -19,6 +21,9 @@ class NetworkOutput {
 
   virtual bool SendPacket(const char* data, std::size_t  data_len);
 
+  // Sends a single packet made of the buffers, with one gathering write.
+  virtual bool SendPacket(const PacketBuffers& buffers);
+
   virtual ~NetworkOutput();
  protected:
   bool EnsureConnectionExists();
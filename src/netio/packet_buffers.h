@@ -0,0 +1,31 @@
+/*
+ * packet_buffers.h
+ *
+ * Packets sent as several buffers, with a single gathering write.
+ */
+
+#ifndef PACKET_BUFFERS_H_
+#define PACKET_BUFFERS_H_
+
+#include <stdint.h>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Parts of a packet, (data, length) pairs sent one after another.
+typedef std::vector<std::pair<const char*, std::size_t> > PacketBuffers;
+
+// Implemented by node environments that send packets with NetworkOutput.
+// Other environments get packets concatenated by the sender.
+class PacketBuffersSender {
+ public:
+  // Sends a single packet made of the |buffers| one after another, just as
+  // SendPacket of their concatenation would. The buffers are not modified
+  // and can be reused when the call returns.
+  virtual void SendPacket(uint32_t target_node,
+                          const PacketBuffers& buffers) = 0;
+
+  virtual ~PacketBuffersSender() {};
+};
+
+#endif /* PACKET_BUFFERS_H_ */
@@ -368,6 +368,9 @@ vector<int> ColumnMap(int query_id) {
     case 10: return CreateVector(3, 1);
     case 11: return CreateVector(1, 2);
     case 12: return CreateVector(1, 1, 2);
+    case 13: return CreateVector(1, 2);
+    case 14: return CreateVector(1, 2, 3);
+    case 15: return CreateVector(1, 2, 1, 3);
     default: assert(false); return vector<int>();
   }
 }
@@ -11,6 +11,7 @@
 #include "utils/logger.h"
 #include "netio/network_input.h"
 #include "netio/network_output.h"
+#include "netio/packet_buffers.h"
 #include "node_environment/data_server.h"
 
 namespace {
@@ -71,7 +72,8 @@ class DataSink : public DataSinkInterface {
 
 // ----------------------------------------------------------------------------
 
-class NodeEnvironment : public NodeEnvironmentInterface {
+class NodeEnvironment : public NodeEnvironmentInterface,
+                        public PacketBuffersSender {
  public:
   NodeEnvironment(uint32 node_number,
                   int query_num,
@@ -101,6 +103,11 @@ class NodeEnvironment : public NodeEnvironmentInterface {
     CHECK(outputs_[target_node]->SendPacket(data, data_len), "");
   }
 
+  virtual void SendPacket(uint32_t target_node, const PacketBuffers& buffers) {
+    CHECK(target_node < nodes_count(), "");
+    CHECK(outputs_[target_node]->SendPacket(buffers), "");
+  }
+
   virtual char* ReadPacketBlocking(std::size_t* data_len) {
     return input_->ReadPacketBlocking(data_len);
   }
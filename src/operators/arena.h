@@ -0,0 +1,82 @@
+// Fast And Furious column database
+// Author: Jacek Migdal <jacek@migdal.pl>
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cassert>
+#include <cstddef>
+#include <vector>
+
+#include "global.h"
+#include "utils/buffer_pool.h"
+
+using std::vector;
+
+/**
+ * Memory of an operator's state, e.g. a group by table. Allocations are
+ * carved out of large blocks from the buffer pool and are never freed one
+ * by one, reset() and the destructor return all the blocks at once.
+ * Not thread safe.
+ */
+class Arena {
+  static const size_t ALIGNMENT = 16;
+
+  vector<char*> blocks;
+  char* current; // free space of the last block
+  size_t available;
+  size_t allocated; // capacity of the blocks
+
+ public:
+  Arena(): current(NULL), available(0), allocated(0) { }
+
+  /** Aligned to 16 bytes, valid until reset */
+  void* allocate(size_t bytes) {
+    bytes = (bytes + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    if (bytes > available) {
+      // large requests get a block of their own
+      size_t blockBytes = bytes > GROUP_BY_ARENA_BLOCK / 4 ?
+        bytes : GROUP_BY_ARENA_BLOCK;
+      char* block = static_cast<char*>(
+          util::BufferPool::Instance().Allocate(blockBytes));
+      blocks.push_back(block);
+      allocated += util::BufferPool::Capacity(block);
+      if (blockBytes != GROUP_BY_ARENA_BLOCK) {
+        return block;
+      }
+      current = block;
+      available = blockBytes;
+    }
+    char* result = current;
+    current += bytes;
+    available -= bytes;
+    return result;
+  }
+
+  /** Frees everything allocated so far */
+  void reset() {
+    util::BufferPool& pool = util::BufferPool::Instance();
+    for (unsigned i = 0 ; i < blocks.size() ; ++i) {
+      pool.Release(blocks[i]);
+    }
+    vector<char*>().swap(blocks);
+    current = NULL;
+    available = 0;
+    allocated = 0;
+  }
+
+  /** Bytes of the blocks held, as reserved by the pool */
+  size_t memoryUsage() const {
+    return allocated;
+  }
+
+  int blockCount() const {
+    return blocks.size();
+  }
+
+  ~Arena() {
+    reset();
+  }
+};
+
+#endif // ARENA_H
@@ -6,13 +6,15 @@
 
 #include <cassert>
 #include <cmath>
+#include <cstring>
 #include <typeinfo>
 
-#include "filter.h"
 #include "factory.h"
 #include "global.h"
 #include "node_environment/node_environment.h"
+#include "utils/buffer_pool.h"
 #include <boost/functional/hash.hpp>
+#include <boost/shared_ptr.hpp>
 
 union any_t {
   int int32;
@@ -21,14 +23,58 @@ union any_t {
   size_t hash;
 };
 
+/** Increasing indices of the rows of a chunk that passed a filter */
+struct SelectionVector {
+  int size;
+  int rows[MAX_CHUNK_SIZE + 8]; // kernels from compaction.h write by 8
+};
+
+/**
+ * Values of a chunk as a constant, runs or a small dictionary. Producers
+ * which notice such a chunk attach the encoding to the column, so that
+ * consumers can work once per distinct value instead of once per row.
+ * The chunk itself stays decoded, consumers may ignore the encoding.
+ */
+template<class T>
+struct ChunkEncoding {
+  enum Kind {
+    CONSTANT,
+    RUN_LENGTH,
+    DICTIONARY
+  };
+  Kind kind;
+  int size; // of values, 1 for a constant
+  T values[ENCODING_MAX_VALUES];
+  int runEnds[ENCODING_MAX_VALUES]; // exclusive, RUN_LENGTH only
+  unsigned char codes[MAX_CHUNK_SIZE]; // indices of values, DICTIONARY only
+
+  /** Encodes n values, returns false if they have too many distinct ones */
+  bool detect(const T* data, int n);
+  /** Sets bit i of n bit bitmap to results[index of value of row i] */
+  void expandBits(const bool* results, char* bitmap, int n) const;
+  /** Sum of the n values */
+  T sum(const T* data, int n) const;
+};
+
+/** Chunks are allocated from the process wide buffer pool */
 class Column {
  public:
   Column(): size(0) { }
+  static void* operator new(size_t bytes) {
+    return util::BufferPool::Instance().Allocate(bytes);
+  }
+  static void operator delete(void* column) {
+    util::BufferPool::Instance().Release(column);
+  }
+  virtual ~Column() { }
   int size;
   virtual query::ColumnType getType() = 0;
   virtual size_t transfuse(char* dst, int offset) = 0;
+  /** Writes rows[0..n) at row at of dst, laid out as by transfuse */
+  virtual void transfuseRows(char* dst, int at, const int* rows, int n) = 0;
   virtual void consume(int column_index, Server* server) = 0;
-  virtual void filter(Column* cond, Column* result) = 0;
+  /** Copies selected rows into result */
+  virtual void select(const SelectionVector& selection, Column* result) = 0;
   virtual void fill(any_t* any, int idx) = 0;
   virtual void addTo(any_t* any, int idx) = 0;
   virtual void take(const any_t& any, int idx) = 0;
@@ -37,17 +83,39 @@ class Column {
   virtual void hash(Column* into) = 0;
 };
 
+/** Rows of global::chunkSize at the time of construction, 64 byte aligned */
 template<class T>
 class ColumnChunk : public Column {
+  T* storage;
+  ColumnChunk(const ColumnChunk&); // chunk would point to the other one
+ protected:
+  /** Without storage, for views */
+  ColumnChunk(T* data): storage(NULL), chunk(data), encoding(NULL),
+    capacity(0) { }
  public:
-  T chunk[DEFAULT_CHUNK_SIZE];
+  ColumnChunk(): encoding(NULL), capacity(global::chunkSize) {
+    storage = static_cast<T*>(
+        util::BufferPool::Instance().Allocate(capacity * sizeof(T)));
+    chunk = storage;
+  }
+  virtual ~ColumnChunk() {
+    util::BufferPool::Instance().Release(storage);
+  }
+  /** Rows, own storage unless it's a ColumnChunkView */
+  T* chunk;
+  /** NULL unless the producer found one, owned by the producer */
+  const ChunkEncoding<T>* encoding;
+  /** of own storage, in rows */
+  int capacity;
   query::ColumnType getType();
   size_t transfuse(char* dst, int offset);
+  void transfuseRows(char* dst, int at, const int* rows, int n);
   void consume(int column_index, Server* server);
   void fill(any_t* any, int idx);
   void addTo(any_t* any, int idx);
   void take(const any_t& any, int idx);
   void zero();
+  void select(const SelectionVector& selection, Column* result);
   void hash(Column* into) {
     assert(into->getType() == query::HASH);
     ColumnChunk<size_t>* intoCasted = static_cast<ColumnChunk<size_t>*>(into);
@@ -55,21 +123,134 @@ class ColumnChunk : public Column {
       boost::hash_combine(intoCasted->chunk[i], chunk[i]);
     }
   }
-  void filter(Column* cond, Column* res) {
-    ColumnChunk<char>* condition = static_cast<ColumnChunk<char>*>(cond);
-    ColumnChunk<T>* result = static_cast<ColumnChunk<T>*>(res);
+};
+
+/** Rows owned by someone else, e.g. a received packet kept alive by owner */
+template<class T>
+class ColumnChunkView : public ColumnChunk<T> {
+  boost::shared_ptr<void> owner;
+ public:
+  ColumnChunkView(T* data, int rows, const boost::shared_ptr<void>& owner_):
+    ColumnChunk<T>(data), owner(owner_) {
+    this->size = rows;
+  }
+};
+
+// ChunkEncoding {{{
 
-    unsigned char* cT = (unsigned char*) condition->chunk;
-    T* target = result->chunk;
+template<class T>
+bool ChunkEncoding<T>::detect(const T* data, int n) {
+  if (n == 0) {
+    return false;
+  }
+  int runs = 1;
+  int distinct = 1;
+  int last = 0; // code of the previous row
+  values[0] = data[0];
+  codes[0] = 0;
+  for (int i = 1 ; i < n ; ++i) {
+    if (data[i] == data[i - 1]) {
+      codes[i] = codes[i - 1];
+      continue;
+    }
+    if (runs < ENCODING_MAX_VALUES) {
+      runEnds[runs - 1] = i;
+    }
+    ++runs;
+    if (distinct <= ENCODING_MAX_VALUES) {
+      last = 0;
+      while (last < distinct && !(values[last] == data[i])) {
+        ++last;
+      }
+      if (last == distinct && distinct < ENCODING_MAX_VALUES) {
+        values[distinct] = data[i];
+      }
+      if (last == distinct) {
+        ++distinct;
+      }
+      codes[i] = last;
+    }
+    if (runs > ENCODING_MAX_VALUES && distinct > ENCODING_MAX_VALUES) {
+      return false;
+    }
+  }
 
-    int rest = 0;
-    for (int i = 0 ; i < size ; i += 8) {
-      rest += filterPrimitive(target, chunk + i, cT[i / 8], rest);
+  if (runs <= ENCODING_MAX_VALUES) {
+    kind = runs == 1 ? CONSTANT : RUN_LENGTH;
+    size = runs;
+    runEnds[runs - 1] = n;
+    // values are in the order of the first occurrence, not of the runs
+    for (int r = 0 ; r < runs ; ++r) {
+      values[r] = data[r == 0 ? 0 : runEnds[r - 1]];
     }
+  } else {
+    kind = DICTIONARY;
+    size = distinct;
+  }
+  return true;
+}
 
-    result->size = rest;
+template<class T>
+void ChunkEncoding<T>::expandBits(const bool* results, char* bitmap,
+    int n) const {
+  int bytes = (n + 7) / 8;
+  switch (kind) {
+    case CONSTANT:
+      memset(bitmap, results[0] ? 0xff : 0, bytes);
+      break;
+    case RUN_LENGTH:
+      memset(bitmap, 0, bytes);
+      for (int r = 0 ; r < size ; ++r) {
+        if (results[r]) {
+          for (int i = r == 0 ? 0 : runEnds[r - 1] ; i < runEnds[r] ; ++i) {
+            bitmap[i / 8] |= 1 << (i & 7);
+          }
+        }
+      }
+      break;
+    default:
+      for (int byte = 0 ; byte < bytes ; ++byte) {
+        int first = byte * 8;
+        int last = first + 8 < n ? first + 8 : n;
+        unsigned char bits = 0;
+        for (int i = first ; i < last ; ++i) {
+          bits |= results[codes[i]] << (i - first);
+        }
+        bitmap[byte] = bits;
+      }
   }
-};
+  if (n % 8 != 0) {
+    bitmap[bytes - 1] &= (1 << (n % 8)) - 1;
+  }
+}
+
+template<class T>
+T ChunkEncoding<T>::sum(const T* data, int n) const {
+  T result = 0;
+  switch (kind) {
+    case CONSTANT:
+      return values[0] * n;
+    case RUN_LENGTH:
+      for (int r = 0 ; r < size ; ++r) {
+        result += values[r] * (runEnds[r] - (r == 0 ? 0 : runEnds[r - 1]));
+      }
+      return result;
+    default:
+      for (int i = 0 ; i < n ; ++i) {
+        result += data[i];
+      }
+      return result;
+  }
+}
+
+/** Attaches encoding to the column if its values have one */
+template<class T>
+inline void encodeColumn(ColumnChunk<T>* column, ChunkEncoding<T>* encoding) {
+  column->encoding =
+    encoding->detect(column->chunk, column->size) ? encoding : NULL;
+}
+
+// }}}
 
 // typeSize, transfuse {{{
 
@@ -100,6 +281,57 @@ ColumnChunk<T>::transfuse(char* dst, int offset) {
   return size * sizeof(T);
 }
 
+template<>
+inline void
+ColumnChunk<char>::transfuseRows(char* dst, int at, const int* rows, int n) {
+  for (int i = 0 ; i < n ; ++i) {
+    int id = i + at;
+    if (chunk[rows[i] / 8] & (1 << (rows[i] & 0x7))) {
+      dst[id / 8] |= 1 << (id & 0x7);
+    } else {
+      dst[id / 8] &= ~(1 << (id & 0x7));
+    }
+  }
+}
+
+template<class T>
+inline void
+ColumnChunk<T>::transfuseRows(char* dst, int at, const int* rows, int n) {
+  T* target = reinterpret_cast<T*>(dst) + at;
+  for (int i = 0 ; i < n ; ++i) {
+    target[i] = chunk[rows[i]];
+  }
+}
+
+// }}}
+
+// select {{{
+
+template<class T>
+inline void
+ColumnChunk<T>::select(const SelectionVector& selection, Column* res) {
+  T* target = static_cast<ColumnChunk<T>*>(res)->chunk;
+  for (int i = 0 ; i < selection.size ; ++i) {
+    target[i] = chunk[selection.rows[i]];
+  }
+  res->size = selection.size;
+}
+
+template<>
+inline void
+ColumnChunk<char>::select(const SelectionVector& selection, Column* res) {
+  char* target = static_cast<ColumnChunk<char>*>(res)->chunk;
+  int n = (selection.size + 7) / 8;
+  for (int i = 0 ; i < n ; ++i) {
+    target[i] = 0;
+  }
+  for (int i = 0 ; i < selection.size ; ++i) {
+    int row = selection.rows[i];
+    target[i / 8] |= ((chunk[row / 8] >> (row & 7)) & 1) << (i & 7);
+  }
+  res->size = selection.size;
+}
+
 // }}}
 
 // consume, fill, addto, take {{{
@@ -249,6 +481,7 @@ class ColumnProvider : public Node {
 template<class T>
 class ColumnProviderServer : public ColumnProvider {
   ColumnChunk<T> columnCache;
+  ChunkEncoding<T> encoding;
   int columnIndex;
  public:
   ColumnProviderServer(int id): columnIndex(id) {}
@@ -269,7 +502,8 @@ template<>
 inline Column*
 ColumnProviderServer<int>::pull() {
   columnCache.size =
-    Factory::server->GetInts(columnIndex, DEFAULT_CHUNK_SIZE, &columnCache.chunk[0]);
+    Factory::server->GetInts(columnIndex, global::chunkSize, &columnCache.chunk[0]);
+  encodeColumn(&columnCache, &encoding);
   return &columnCache;
 }
 
@@ -277,7 +511,8 @@ template<>
 inline Column*
 ColumnProviderServer<double>::pull() {
   columnCache.size =
-    Factory::server->GetDoubles(columnIndex, DEFAULT_CHUNK_SIZE, &columnCache.chunk[0]);
+    Factory::server->GetDoubles(columnIndex, global::chunkSize, &columnCache.chunk[0]);
+  encodeColumn(&columnCache, &encoding);
   return &columnCache;
 }
 
@@ -285,7 +520,7 @@ template<>
 inline Column*
 ColumnProviderServer<char>::pull() {
   columnCache.size =
-    Factory::server->GetBitBools(columnIndex, DEFAULT_CHUNK_SIZE, &columnCache.chunk[0]);
+    Factory::server->GetBitBools(columnIndex, global::chunkSize, &columnCache.chunk[0]);
   return &columnCache;
 }
 // }}}
@@ -296,7 +531,7 @@ deserializeChunk(int from_row, const char bytes[], size_t rows) {
   //printf("deserializeChunk...\n");
   ColumnChunk<T> *col = new ColumnChunk<T>();
   const T* values = reinterpret_cast<const T*>(bytes);
-  assert(rows <= (size_t) DEFAULT_CHUNK_SIZE);
+  assert(rows <= (size_t) col->capacity);
   std::copy(values + from_row, values + from_row + rows, col->chunk);
   col->size = rows;
   return col;
@@ -307,8 +542,8 @@ inline ColumnChunk<char>*
 deserializeChunk(int from_row, const char bytes[], size_t rows) {
   //printf("deserializeChunk...\n");
   ColumnChunk<char> *col = new ColumnChunk<char>();
-  assert(rows <= (size_t) DEFAULT_CHUNK_SIZE);
-  memset(col->chunk, 0, DEFAULT_CHUNK_SIZE);
+  assert(rows <= (size_t) col->capacity);
+  memset(col->chunk, 0, col->capacity);
   for (unsigned i = 0 ; i < rows ; ++i) {
     unsigned id = i + from_row;
     if (bytes[id / 8] & (1 << (id & 0x7))) {
@@ -323,6 +558,7 @@ deserializeChunk(int from_row, const char bytes[], size_t rows) {
 template<class T>
 class ColumnProviderFile : public ColumnProvider {
   ColumnChunk<T> columnCache;
+  ChunkEncoding<T> encoding;
   DataSourceInterface** source;
   int columnIndex;
  public:
@@ -345,7 +581,8 @@ template<>
 inline Column*
 ColumnProviderFile<int>::pull() {
   columnCache.size =
-      (*source)->GetInts(columnIndex, DEFAULT_CHUNK_SIZE, &columnCache.chunk[0]);
+      (*source)->GetInts(columnIndex, global::chunkSize, &columnCache.chunk[0]);
+  encodeColumn(&columnCache, &encoding);
   return &columnCache;
 }
 
@@ -353,7 +590,8 @@ template<>
 inline Column*
 ColumnProviderFile<double>::pull() {
   columnCache.size =
-      (*source)->GetDoubles(columnIndex, DEFAULT_CHUNK_SIZE, &columnCache.chunk[0]);
+      (*source)->GetDoubles(columnIndex, global::chunkSize, &columnCache.chunk[0]);
+  encodeColumn(&columnCache, &encoding);
   return &columnCache;
 }
 
@@ -361,7 +599,7 @@ template<>
 inline Column*
 ColumnProviderFile<char>::pull() {
   columnCache.size =
-      (*source)->GetBitBools(columnIndex, DEFAULT_CHUNK_SIZE, &columnCache.chunk[0]);
+      (*source)->GetBitBools(columnIndex, global::chunkSize, &columnCache.chunk[0]);
   return &columnCache;
 }
 // }}}
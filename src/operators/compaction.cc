@@ -0,0 +1,158 @@
+// Fast And Furious column database
+// Author: Jacek Migdal <jacek@migdal.pl>
+
+#include "compaction.h"
+
+#include <cstring>
+#include <stdint.h>
+#include <immintrin.h>
+
+// Index table {{{
+// For every bitmap byte: positions of its set bits, padded with zeros,
+// and their number.
+struct IndexTable {
+  unsigned char indices[256][8];
+  int counts[256];
+
+  IndexTable() {
+    for (int mask = 0 ; mask < 256 ; ++mask) {
+      int count = 0;
+      memset(indices[mask], 0, 8);
+      for (int bit = 0 ; bit < 8 ; ++bit) {
+        if (mask & (1 << bit)) {
+          indices[mask][count++] = bit;
+        }
+      }
+      counts[mask] = count;
+    }
+  }
+};
+
+static const IndexTable indexTable;
+// }}}
+
+/** Scalar selection of rows [from, n) */
+static inline int selectRowsFrom(const unsigned char* bitmap, int from, int n,
+    int* rows) {
+  int count = 0;
+  for (int i = from ; i < n ; ++i) {
+    rows[count] = i;
+    count += (bitmap[i / 8] >> (i & 7)) & 1;
+  }
+  return count;
+}
+
+int selectRowsScalar(const unsigned char* bitmap, int n, int* rows) {
+  return selectRowsFrom(bitmap, 0, n, rows);
+}
+
+__attribute__((target("sse4.1")))
+int selectRowsSse(const unsigned char* bitmap, int n, int* rows) {
+  int count = 0;
+  int bytes = n / 8;
+  for (int b = 0 ; b < bytes ; ++b) {
+    unsigned char mask = bitmap[b];
+    __m128i base = _mm_set1_epi32(b * 8);
+    __m128i idx = _mm_loadl_epi64((const __m128i*) indexTable.indices[mask]);
+    __m128i low = _mm_add_epi32(_mm_cvtepu8_epi32(idx), base);
+    __m128i high = _mm_add_epi32(_mm_cvtepu8_epi32(_mm_srli_si128(idx, 4)), base);
+    _mm_storeu_si128((__m128i*) (rows + count), low);
+    _mm_storeu_si128((__m128i*) (rows + count + 4), high);
+    count += indexTable.counts[mask];
+  }
+  return count + selectRowsFrom(bitmap, bytes * 8, n, rows + count);
+}
+
+__attribute__((target("avx2")))
+int selectRowsAvx2(const unsigned char* bitmap, int n, int* rows) {
+  int count = 0;
+  int bytes = n / 8;
+  for (int b = 0 ; b < bytes ; ++b) {
+    unsigned char mask = bitmap[b];
+    __m128i idx = _mm_loadl_epi64((const __m128i*) indexTable.indices[mask]);
+    __m256i wide = _mm256_add_epi32(_mm256_cvtepu8_epi32(idx),
+        _mm256_set1_epi32(b * 8));
+    _mm256_storeu_si256((__m256i*) (rows + count), wide);
+    count += indexTable.counts[mask];
+  }
+  return count + selectRowsFrom(bitmap, bytes * 8, n, rows + count);
+}
+
+__attribute__((target("bmi2,popcnt,sse4.1")))
+int selectRowsPext(const unsigned char* bitmap, int n, int* rows) {
+  int count = 0;
+  int bytes = n / 8;
+  for (int b = 0 ; b < bytes ; ++b) {
+    unsigned mask = bitmap[b];
+    // byte i of selected is 0xff if bit i is set
+    uint64_t selected = _pdep_u64(mask, 0x0101010101010101ULL) * 0xff;
+    uint64_t packed = _pext_u64(0x0706050403020100ULL, selected);
+    __m128i base = _mm_set1_epi32(b * 8);
+    __m128i idx = _mm_cvtsi64_si128(packed);
+    __m128i low = _mm_add_epi32(_mm_cvtepu8_epi32(idx), base);
+    __m128i high = _mm_add_epi32(_mm_cvtepu8_epi32(_mm_srli_si128(idx, 4)), base);
+    _mm_storeu_si128((__m128i*) (rows + count), low);
+    _mm_storeu_si128((__m128i*) (rows + count + 4), high);
+    count += __builtin_popcount(mask);
+  }
+  return count + selectRowsFrom(bitmap, bytes * 8, n, rows + count);
+}
+
+__attribute__((target("avx512f,popcnt")))
+int selectRowsAvx512(const unsigned char* bitmap, int n, int* rows) {
+  const __m512i iota = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7,
+      8, 9, 10, 11, 12, 13, 14, 15);
+  int count = 0;
+  int blocks = n / 16;
+  for (int b = 0 ; b < blocks ; ++b) {
+    uint16_t mask;
+    memcpy(&mask, bitmap + 2 * b, 2);
+    __m512i idx = _mm512_add_epi32(iota, _mm512_set1_epi32(b * 16));
+    _mm512_mask_compressstoreu_epi32(rows + count, mask, idx);
+    count += __builtin_popcount(mask);
+  }
+  return count + selectRowsFrom(bitmap, blocks * 16, n, rows + count);
+}
+
+// Dispatch {{{
+static SelectRowsVariant variants[] = {
+  { "scalar", selectRowsScalar, true },
+  { "sse4.1", selectRowsSse, false },
+  { "pext", selectRowsPext, false },
+  { "avx2", selectRowsAvx2, false },
+  { "avx512", selectRowsAvx512, false },
+};
+static const int variantsCount = sizeof(variants) / sizeof(variants[0]);
+static int chosen = 0;
+
+/*
+ * Variants are ordered from the slowest, the last supported one wins.
+ * PEXT goes before AVX2 as it's microcoded on AMD before Zen 3.
+ */
+static SelectRowsKernel chooseSelectRows() {
+  __builtin_cpu_init();
+  variants[1].supported = __builtin_cpu_supports("sse4.1");
+  variants[2].supported = __builtin_cpu_supports("bmi2") &&
+    __builtin_cpu_supports("popcnt") && __builtin_cpu_supports("sse4.1");
+  variants[3].supported = __builtin_cpu_supports("avx2");
+  variants[4].supported = __builtin_cpu_supports("avx512f") &&
+    __builtin_cpu_supports("popcnt");
+  for (int i = 0 ; i < variantsCount ; ++i) {
+    if (variants[i].supported) {
+      chosen = i;
+    }
+  }
+  return variants[chosen].kernel;
+}
+
+SelectRowsKernel selectRows = chooseSelectRows();
+
+const char* selectRowsName() {
+  return variants[chosen].name;
+}
+
+const SelectRowsVariant* selectRowsVariants(int* count) {
+  *count = variantsCount;
+  return variants;
+}
+// }}}
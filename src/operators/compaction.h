@@ -0,0 +1,39 @@
+// Fast And Furious column database
+// Author: Jacek Migdal <jacek@migdal.pl>
+
+#ifndef COMPACTION_H
+#define COMPACTION_H
+
+/**
+ * Kernels turning a filter bitmap into indices of rows that passed, see
+ * FilterOperation::pullSelected. Each writes indices of set bits among the
+ * first n bits of bitmap to rows and returns their number. Kernels store
+ * whole groups of 8 indices, so rows needs room for n rounded up to 8.
+ */
+typedef int (*SelectRowsKernel)(const unsigned char* bitmap, int n, int* rows);
+
+/** Reference version, a branch-free loop over bits */
+int selectRowsScalar(const unsigned char* bitmap, int n, int* rows);
+/** Indices of a bitmap byte from a 256 entry table, widened with SSE4.1 */
+int selectRowsSse(const unsigned char* bitmap, int n, int* rows);
+/** Same table as selectRowsSse, 8 indices widened and stored at once */
+int selectRowsAvx2(const unsigned char* bitmap, int n, int* rows);
+/** Indices of a bitmap byte extracted with BMI2 PEXT, no table */
+int selectRowsPext(const unsigned char* bitmap, int n, int* rows);
+/** AVX-512 compress store, 16 rows a time */
+int selectRowsAvx512(const unsigned char* bitmap, int n, int* rows);
+
+struct SelectRowsVariant {
+  const char* name;
+  SelectRowsKernel kernel;
+  bool supported;
+};
+
+/** All the kernels, the scalar one first, for benchmarks */
+const SelectRowsVariant* selectRowsVariants(int* count);
+
+/** The fastest kernel the CPU supports, chosen on startup */
+extern SelectRowsKernel selectRows;
+const char* selectRowsName();
+
+#endif // COMPACTION_H
@@ -0,0 +1,258 @@
+// Fast And Furious column database
+// Author: Jacek Migdal <jacek@migdal.pl>
+
+#include "comparison.h"
+
+#include <immintrin.h>
+
+template<Comparison op, class TL, class TR>
+static inline bool compare(TL a, TR b) {
+  switch (op) {
+    case LOWER:
+      return a < b;
+    case EQUAL:
+      return a == b;
+    default:
+      return a != b;
+  }
+}
+
+/** Operand with the same value in every row, indexed like an array */
+template<class T>
+struct Constant {
+  T value;
+  explicit Constant(T value_): value(value_) { }
+  T operator[](int i) const { return value; }
+  Constant operator+(int i) const { return *this; }
+};
+
+template<class T>
+struct Element;
+
+template<class T>
+struct Element<const T*> {
+  typedef T type;
+};
+
+template<class T>
+struct Element<Constant<T> > {
+  typedef T type;
+};
+
+/**
+ * Compares rows [from, n), from has to be a multiple of 8. Operands are
+ * arrays or Constants.
+ */
+template<Comparison op, class A, class B>
+static inline void compareScalar(A a, B b, char* target, int from, int n) {
+  for (int byte = from / 8 ; byte * 8 < n ; ++byte) {
+    int first = byte * 8;
+    int last = first + 8 < n ? first + 8 : n;
+    unsigned char bits = 0;
+    for (int i = first ; i < last ; ++i) {
+      bits |= compare<op>(a[i], b[i]) << (i - first);
+    }
+    target[byte] = bits;
+  }
+}
+
+/** Rows [from, n) */
+template<class T>
+static inline void blendScalar(const unsigned char* condition, const T* a,
+    const T* b, T* target, int from, int n) {
+  for (int i = from ; i < n ; ++i) {
+    target[i] = (condition[i / 8] >> (i & 7)) & 1 ? a[i] : b[i];
+  }
+}
+
+// AVX2 {{{
+__attribute__((target("avx2")))
+static inline __m256d load4(const double* p) {
+  return _mm256_loadu_pd(p);
+}
+
+__attribute__((target("avx2")))
+static inline __m256d load4(const int* p) {
+  // exact, as when int is compared with double in C++
+  return _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i*) p));
+}
+
+template<class T>
+__attribute__((target("avx2")))
+static inline __m256d load4(Constant<T> c) {
+  return _mm256_set1_pd(c.value);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i load8(const int* p) {
+  return _mm256_loadu_si256((const __m256i*) p);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i load8(Constant<int> c) {
+  return _mm256_set1_epi32(c.value);
+}
+
+template<Comparison op>
+__attribute__((target("avx2")))
+static inline int mask4(__m256d a, __m256d b) {
+  switch (op) {
+    case LOWER:
+      return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_LT_OQ));
+    case EQUAL:
+      return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_EQ_OQ));
+    default:
+      // unordered, so NaN != x like in C++
+      return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_NEQ_UQ));
+  }
+}
+
+/** Bitmap byte of 8 rows of operands of element types TL and TR */
+template<Comparison op, class TL, class TR>
+struct CompareByte {
+  template<class A, class B>
+  __attribute__((target("avx2")))
+  static inline unsigned char get(A a, B b) {
+    return mask4<op>(load4(a), load4(b)) |
+      (mask4<op>(load4(a + 4), load4(b + 4)) << 4);
+  }
+};
+
+template<Comparison op>
+struct CompareByte<op, int, int> {
+  template<class A, class B>
+  __attribute__((target("avx2")))
+  static inline unsigned char get(A a, B b) {
+    __m256i left = load8(a);
+    __m256i right = load8(b);
+    __m256i result;
+    switch (op) {
+      case LOWER:
+        result = _mm256_cmpgt_epi32(right, left);
+        break;
+      case EQUAL:
+        result = _mm256_cmpeq_epi32(left, right);
+        break;
+      default:
+        result = _mm256_xor_si256(_mm256_cmpeq_epi32(left, right),
+            _mm256_set1_epi32(-1));
+    }
+    return _mm256_movemask_ps(_mm256_castsi256_ps(result));
+  }
+};
+
+template<Comparison op, class A, class B>
+__attribute__((target("avx2")))
+static void compareAvx2(A a, B b, char* target, int n) {
+  typedef CompareByte<op, typename Element<A>::type,
+          typename Element<B>::type> Byte;
+  int bytes = n / 8;
+  for (int i = 0 ; i < bytes ; ++i) {
+    target[i] = Byte::get(a + 8 * i, b + 8 * i);
+  }
+  compareScalar<op>(a, b, target, bytes * 8, n);
+}
+
+__attribute__((target("avx2")))
+static void blendAvx2(const unsigned char* condition, const int* a,
+    const int* b, int* target, int n) {
+  const __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  int bytes = n / 8;
+  for (int i = 0 ; i < bytes ; ++i) {
+    __m256i mask = _mm256_and_si256(_mm256_set1_epi32(condition[i]), bits);
+    mask = _mm256_cmpeq_epi32(mask, bits);
+    __m256i left = _mm256_loadu_si256((const __m256i*) (a + 8 * i));
+    __m256i right = _mm256_loadu_si256((const __m256i*) (b + 8 * i));
+    _mm256_storeu_si256((__m256i*) (target + 8 * i),
+        _mm256_blendv_epi8(right, left, mask));
+  }
+  blendScalar(condition, a, b, target, bytes * 8, n);
+}
+
+__attribute__((target("avx2")))
+static void blendAvx2(const unsigned char* condition, const double* a,
+    const double* b, double* target, int n) {
+  const __m256i bits = _mm256_setr_epi64x(1, 2, 4, 8);
+  int quads = n / 4;
+  for (int i = 0 ; i < quads ; ++i) {
+    __m256i mask = _mm256_set1_epi64x(condition[i / 2] >> ((i & 1) * 4));
+    mask = _mm256_cmpeq_epi64(_mm256_and_si256(mask, bits), bits);
+    __m256d left = _mm256_loadu_pd(a + 4 * i);
+    __m256d right = _mm256_loadu_pd(b + 4 * i);
+    _mm256_storeu_pd(target + 4 * i,
+        _mm256_blendv_pd(right, left, _mm256_castsi256_pd(mask)));
+  }
+  blendScalar(condition, a, b, target, quads * 4, n);
+}
+// }}}
+
+static bool hasAvx2() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+
+static const bool avx2 = hasAvx2();
+
+template<Comparison op, class A, class B>
+static inline void compareOperands(A a, B b, char* target, int n) {
+  if (avx2) {
+    compareAvx2<op>(a, b, target, n);
+  } else {
+    compareScalar<op>(a, b, target, 0, n);
+  }
+}
+
+template<Comparison op, class TL, class TR>
+void compareColumns(const TL* a, const TR* b, char* target, int n) {
+  compareOperands<op>(a, b, target, n);
+}
+
+template<Comparison op, class TL, class TR>
+void compareColumnConstant(const TL* a, TR b, char* target, int n) {
+  compareOperands<op>(a, Constant<TR>(b), target, n);
+}
+
+template<Comparison op, class TL, class TR>
+void compareConstantColumn(TL a, const TR* b, char* target, int n) {
+  compareOperands<op>(Constant<TL>(a), b, target, n);
+}
+
+template<class T>
+void blendColumns(const char* condition, const T* a, const T* b, T* target,
+    int n) {
+  if (avx2) {
+    blendAvx2((const unsigned char*) condition, a, b, target, n);
+  } else {
+    blendScalar((const unsigned char*) condition, a, b, target, 0, n);
+  }
+}
+
+/** Bitmaps, a byte is 8 rows */
+template<>
+void blendColumns<char>(const char* condition, const char* a, const char* b,
+    char* target, int n) {
+  for (int i = 0 ; i < (n + 7) / 8 ; ++i) {
+    target[i] = (condition[i] & a[i]) | (~condition[i] & b[i]);
+  }
+}
+
+template void blendColumns<int>(const char*, const int*, const int*, int*,
+    int);
+template void blendColumns<double>(const char*, const double*,
+    const double*, double*, int);
+
+#define INSTANTIATE_OP(op, TL, TR) \
+  template void compareColumns<op>(const TL*, const TR*, char*, int); \
+  template void compareColumnConstant<op>(const TL*, TR, char*, int); \
+  template void compareConstantColumn<op>(TL, const TR*, char*, int);
+#define INSTANTIATE(TL, TR) \
+  INSTANTIATE_OP(LOWER, TL, TR) \
+  INSTANTIATE_OP(EQUAL, TL, TR) \
+  INSTANTIATE_OP(NOT_EQUAL, TL, TR)
+
+INSTANTIATE(int, int)
+INSTANTIATE(double, double)
+INSTANTIATE(int, double)
+INSTANTIATE(double, int)
+#undef INSTANTIATE
+#undef INSTANTIATE_OP
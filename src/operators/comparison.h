@@ -0,0 +1,38 @@
+// Fast And Furious column database
+// Author: Jacek Migdal <jacek@migdal.pl>
+
+#ifndef COMPARISON_H
+#define COMPARISON_H
+
+enum Comparison {
+  LOWER,
+  EQUAL,
+  NOT_EQUAL
+};
+
+/**
+ * Sets bit i of the target bitmap to a[i] op b[i] for i < n, bits past n in
+ * the last byte are cleared. Whole bitmap bytes are written at once, with
+ * AVX2 compare and movemask if the CPU supports it.
+ * Instantiated for int and double operands, see comparison.cc.
+ */
+template<Comparison op, class TL, class TR>
+void compareColumns(const TL* a, const TR* b, char* target, int n);
+
+/** Same as compareColumns with b[i] == b (a[i] == a) for every row */
+template<Comparison op, class TL, class TR>
+void compareColumnConstant(const TL* a, TR b, char* target, int n);
+template<Comparison op, class TL, class TR>
+void compareConstantColumn(TL a, const TR* b, char* target, int n);
+
+/**
+ * Sets target[i] to a[i] if bit i of the condition bitmap is set and to b[i]
+ * otherwise, for i < n, without branches. For char the columns are bitmaps
+ * too. Uses AVX2 blends if the CPU supports it.
+ * Instantiated for int, double and char, see comparison.cc.
+ */
+template<class T>
+void blendColumns(const char* condition, const T* a, const T* b, T* target,
+    int n);
+
+#endif // COMPARISON_H
@@ -5,10 +5,13 @@
 #define EXPRESSION_H
 
 #include <vector>
+#include <map>
 #include <string>
 #include <algorithm>
 
 #include "column.h"
+#include "comparison.h"
+#include "compaction.h"
 
 using std::swap;
 using std::vector;
@@ -17,6 +20,18 @@ using std::string;
 class Expression : public Node {
  public:
   virtual Column* pull(vector<Column*>* sources) = 0;
+  /**
+   * Like pull, but only rows in selection have to be evaluated, values of
+   * other rows of the result are undefined.
+   */
+  virtual Column* pullSelected(vector<Column*>* sources,
+      const SelectionVector& selection) {
+    return pull(sources);
+  }
+  /** Estimated cost of evaluating a row, an addition costs 1 */
+  virtual double cost() {
+    return 1.0;
+  }
   virtual query::ColumnType getType() = 0;
   virtual ~Expression() { };
 };
@@ -39,6 +54,18 @@ class Expression1 : public Expression {
     return &cache;
   }
 
+  Column* pullSelected(vector<Column*>* sources,
+      const SelectionVector& selection) {
+    Column* leftData = left->pullSelected(sources, selection);
+    cache.size = leftData->size;
+    pullInternal(leftData);
+    return &cache;
+  }
+
+  double cost() {
+    return 1.0 + left->cost();
+  }
+
   query::ColumnType getType() {
     return global::getType<T>();
   }
@@ -71,6 +98,19 @@ class Expression2 : public Expression {
     return &cache;
   }
 
+  /** Operator itself is cheap, it's evaluated on all the rows anyway */
+  Column* pullSelected(vector<Column*>* sources,
+      const SelectionVector& selection) {
+    Column* leftData = left->pullSelected(sources, selection);
+    Column* rightData = right->pullSelected(sources, selection);
+    pullInternal(leftData, rightData);
+    return &cache;
+  }
+
+  double cost() {
+    return 1.0 + left->cost() + right->cost();
+  }
+
   query::ColumnType getType() {
     return global::getType<T>();
   }
@@ -95,6 +135,10 @@ class ExpressionColumn : public Expression {
     return (*sources)[columnId];
   }
 
+  double cost() {
+    return 0.0;
+  }
+
   std::ostream& debugPrint(std::ostream& output) {
     return output << "ExpressionColumn(" << columnId
         << ": " << global::getTypeName<T>() << ")";
@@ -106,13 +150,28 @@ class ExpressionColumn : public Expression {
   virtual ~ExpressionColumn() { };
 };
 
+/**
+ * The chunk of copies is filled once, for operators that read chunks only.
+ * Arithmetic and comparisons take the value of the CONSTANT encoding.
+ */
 template<class T>
 class ExpressionConstant : public Expression {
   T val;
   ColumnChunk<T> chunk;
+  ChunkEncoding<T> encoding;
+
+  void encode() {
+    // bitmaps have no encodings
+    if (global::getType<T>() != query::BOOL) {
+      encoding.kind = ChunkEncoding<T>::CONSTANT;
+      encoding.size = 1;
+      encoding.values[0] = val;
+      chunk.encoding = &encoding;
+    }
+  }
  public:
   ExpressionConstant(bool v) {
-    chunk.size = DEFAULT_CHUNK_SIZE;
+    chunk.size = global::chunkSize;
     if (v) {
       val = 0xff;
     } else {
@@ -121,22 +180,30 @@ class ExpressionConstant : public Expression {
     for (int i = 0 ; i < chunk.size ; ++i) {
       chunk.chunk[i] = val;
     }
+    encode();
   }
   ExpressionConstant(T v): val(v) {
-    chunk.size = DEFAULT_CHUNK_SIZE;
+    chunk.size = global::chunkSize;
     for (int i = 0 ; i < chunk.size ; ++i) {
       chunk.chunk[i] = val;
     }
+    encode();
   }
   Column* pull(vector<Column*>* sources) {
     if ((*sources).size() > 0) {
       chunk.size = (*sources)[0]->size;
     } else {
-      chunk.size = DEFAULT_CHUNK_SIZE;
+      chunk.size = global::chunkSize;
     }
+    // filled when built, global::chunkSize mustn't grow since
+    assert(chunk.size <= chunk.capacity);
     return &chunk;
   }
 
+  double cost() {
+    return 0.0;
+  }
+
   std::ostream& debugPrint(std::ostream& output) {
     return output << "ExpressionConstant(" << val << ")";
   }
@@ -148,251 +215,301 @@ class ExpressionConstant : public Expression {
   virtual ~ExpressionConstant() { };
 };
 
-// Add {{{
+// Arithmetic {{{
+// operators, shared with FusedExpression
 template<class T>
-class ExpressionAdd : public Expression2<T> {
- public:
-  ExpressionAdd(Expression* l, Expression* r): Expression2<T>(l, r) { }
+struct ArithmeticAdd {
+  static T apply(T a, T b) { return a + b; }
+};
 
-  void pullInternal(Column* a, Column* b);
+template<class T>
+struct ArithmeticSubtract {
+  static T apply(T a, T b) { return a - b; }
+};
 
-  virtual ~ExpressionAdd() { };
+template<class T>
+struct ArithmeticMultiply {
+  static T apply(T a, T b) { return a * b; }
 };
 
-template<>
-inline void
-ExpressionAdd<int>::pullInternal(Column* a, Column* b) {
-  int* aT = ((ColumnChunk<int>*) a)->chunk;
-  int* bT = ((ColumnChunk<int>*) b)->chunk;
-  int* target = cache.chunk;
+template<class T>
+struct ArithmeticDivide {
+  static T apply(T a, T b) { return a / b; }
+};
 
-  cache.size = a->size;
+/** Unary, b is the same as a */
+template<class T>
+struct ArithmeticNegate {
+  static T apply(T a, T b) { return -a; }
+};
 
-  for (int i = 0 ; i < cache.size ; ++i) {
-    target[i] = aT[i] + bT[i];
-  }
+template<class T>
+inline const ChunkEncoding<T>* constantEncoding(Column* column) {
+  const ChunkEncoding<T>* encoding =
+    static_cast<ColumnChunk<T>*>(column)->encoding;
+  return encoding != NULL && encoding->kind == ChunkEncoding<T>::CONSTANT ?
+    encoding : NULL;
 }
 
-template<>
-inline void
-ExpressionAdd<double>::pullInternal(Column* a, Column* b) {
-  cache.size = a->size;
-  double* target = cache.chunk;
-
-  if (dynamic_cast<ColumnChunk<double>*>(a) == NULL ||
-      dynamic_cast<ColumnChunk<double>*>(b) == NULL
-      ) {
-    if (dynamic_cast<ColumnChunk<double>*>(a) == NULL) {
-      swap(a, b);
+/**
+ * target[i] = Op::apply(a[i], b[i]) with operands converted to T. A constant
+ * operand, e.g. of ExpressionConstant, is a scalar instead of a chunk.
+ */
+template<class Op, class T, class TA, class TB>
+inline void applyArithmetic(Column* a, Column* b, T* target, int n) {
+  TA* aT = static_cast<ColumnChunk<TA>*>(a)->chunk;
+  TB* bT = static_cast<ColumnChunk<TB>*>(b)->chunk;
+  const ChunkEncoding<TA>* aE = constantEncoding<TA>(a);
+  const ChunkEncoding<TB>* bE = constantEncoding<TB>(b);
+  if (bE != NULL) {
+    T value = bE->values[0];
+    for (int i = 0 ; i < n ; ++i) {
+      target[i] = Op::apply(aT[i], value);
     }
-    double *aT = ((ColumnChunk<double>*) a)->chunk; 
-    int *bT = ((ColumnChunk<int>*) b)->chunk; 
-
-    for (int i = 0 ; i < cache.size ; ++i) {
-      target[i] = aT[i] + bT[i];
+  } else if (aE != NULL) {
+    T value = aE->values[0];
+    for (int i = 0 ; i < n ; ++i) {
+      target[i] = Op::apply(value, bT[i]);
     }
   } else {
-    double *aT = ((ColumnChunk<double>*) a)->chunk; 
-    double *bT = ((ColumnChunk<double>*) b)->chunk; 
-
-    for (int i = 0 ; i < cache.size ; ++i) {
-      target[i] = aT[i] + bT[i];
+    for (int i = 0 ; i < n ; ++i) {
+      target[i] = Op::apply(aT[i], bT[i]);
     }
   }
 }
 
-template<>
-inline void
-ExpressionAdd<char>::pullInternal(Column* a, Column* b) {
-  assert(false);
+/** Operands are INT or DOUBLE chunks, in any combination */
+template<class Op, class T>
+inline void applyArithmetic(Column* a, Column* b, T* target, int n) {
+  if (dynamic_cast<ColumnChunk<double>*>(a) == NULL) {
+    if (dynamic_cast<ColumnChunk<double>*>(b) == NULL) {
+      applyArithmetic<Op, T, int, int>(a, b, target, n);
+    } else {
+      applyArithmetic<Op, T, int, double>(a, b, target, n);
+    }
+  } else {
+    if (dynamic_cast<ColumnChunk<double>*>(b) == NULL) {
+      applyArithmetic<Op, T, double, int>(a, b, target, n);
+    } else {
+      applyArithmetic<Op, T, double, double>(a, b, target, n);
+    }
+  }
 }
-// }}}
 
-// Minus {{{
-template<class T>
-class ExpressionMinus : public Expression2<T> {
+template<class T, template<class> class Op>
+class ExpressionArithmetic : public Expression2<T> {
  public:
-  ExpressionMinus(Expression* l, Expression* r): Expression2<T>(l, r) { }
+  ExpressionArithmetic(Expression* l, Expression* r): Expression2<T>(l, r) { }
 
-  void pullInternal(Column* a, Column* b);
+  void pullInternal(Column* a, Column* b) {
+    this->cache.size = a->size;
+    applyArithmetic<Op<T>, T>(a, b, this->cache.chunk, a->size);
+  }
 
-  virtual ~ExpressionMinus() { };
+  virtual ~ExpressionArithmetic() { };
 };
+// }}}
 
-template<>
-inline void
-ExpressionMinus<int>::pullInternal(Column* a, Column* b) {
-  int* aT = ((ColumnChunk<int>*) a)->chunk;
-  int* bT = ((ColumnChunk<int>*) b)->chunk;
-  int* target = cache.chunk;
-
-  cache.size = a->size;
+// Add {{{
+template<class T>
+class ExpressionAdd : public ExpressionArithmetic<T, ArithmeticAdd> {
+ public:
+  ExpressionAdd(Expression* l, Expression* r):
+    ExpressionArithmetic<T, ArithmeticAdd>(l, r) { }
 
-  for (int i = 0 ; i < cache.size ; ++i) {
-    target[i] = aT[i] - bT[i];
-  }
-}
+  virtual ~ExpressionAdd() { };
+};
 
 template<>
 inline void
-ExpressionMinus<double>::pullInternal(Column* a, Column* b) {
-  cache.size = a->size;
-  double* target = cache.chunk;
-
-  if (dynamic_cast<ColumnChunk<double>*>(a) == NULL ||
-      dynamic_cast<ColumnChunk<double>*>(b) == NULL
-      ) {
-    if (dynamic_cast<ColumnChunk<double>*>(a) == NULL) {
-      swap(a, b);
-    }
-    double *aT = ((ColumnChunk<double>*) a)->chunk; 
-    int *bT = ((ColumnChunk<int>*) b)->chunk; 
+ExpressionArithmetic<char, ArithmeticAdd>::pullInternal(Column* a, Column* b) {
+  assert(false);
+}
+// }}}
 
-    for (int i = 0 ; i < cache.size ; ++i) {
-      target[i] = aT[i] - bT[i];
-    }
-  } else {
-    double *aT = ((ColumnChunk<double>*) a)->chunk; 
-    double *bT = ((ColumnChunk<double>*) b)->chunk; 
+// Minus {{{
+template<class T>
+class ExpressionMinus : public ExpressionArithmetic<T, ArithmeticSubtract> {
+ public:
+  ExpressionMinus(Expression* l, Expression* r):
+    ExpressionArithmetic<T, ArithmeticSubtract>(l, r) { }
 
-    for (int i = 0 ; i < cache.size ; ++i) {
-      target[i] = aT[i] - bT[i];
-    }
-  }
-}
+  virtual ~ExpressionMinus() { };
+};
 
 template<>
 inline void
-ExpressionMinus<char>::pullInternal(Column* a, Column* b) {
+ExpressionArithmetic<char, ArithmeticSubtract>::pullInternal(Column* a,
+    Column* b) {
   assert(false);
 }
 // }}}
 
 // Multiply {{{
 template<class T>
-class ExpressionMultiply : public Expression2<T> {
+class ExpressionMultiply : public ExpressionArithmetic<T, ArithmeticMultiply> {
  public:
-  ExpressionMultiply(Expression* l, Expression* r): Expression2<T>(l, r) { }
-
-  void pullInternal(Column* a, Column* b);
+  ExpressionMultiply(Expression* l, Expression* r):
+    ExpressionArithmetic<T, ArithmeticMultiply>(l, r) { }
 
   virtual ~ExpressionMultiply() { };
 };
 
 template<>
 inline void
-ExpressionMultiply<int>::pullInternal(Column* a, Column* b) {
-  int* aT = ((ColumnChunk<int>*) a)->chunk;
-  int* bT = ((ColumnChunk<int>*) b)->chunk;
-  int* target = cache.chunk;
-
-  cache.size = a->size;
-
-  for (int i = 0 ; i < cache.size ; ++i) {
-    target[i] = aT[i] * bT[i];
-  }
-}
-
-template<>
-inline void
-ExpressionMultiply<double>::pullInternal(Column* a, Column* b) {
-  cache.size = a->size;
-  double* target = cache.chunk;
-
-  if (dynamic_cast<ColumnChunk<double>*>(a) == NULL ||
-      dynamic_cast<ColumnChunk<double>*>(b) == NULL
-      ) {
-    if (dynamic_cast<ColumnChunk<double>*>(a) == NULL) {
-      swap(a, b);
-    }
-    double *aT = ((ColumnChunk<double>*) a)->chunk; 
-    int *bT = ((ColumnChunk<int>*) b)->chunk; 
-
-    for (int i = 0 ; i < cache.size ; ++i) {
-      target[i] = aT[i] * bT[i];
-    }
-  } else {
-    double *aT = ((ColumnChunk<double>*) a)->chunk; 
-    double *bT = ((ColumnChunk<double>*) b)->chunk; 
-
-    for (int i = 0 ; i < cache.size ; ++i) {
-      target[i] = aT[i] * bT[i];
-    }
-  }
-}
-
-template<>
-inline void
-ExpressionMultiply<char>::pullInternal(Column* a, Column* b) {
+ExpressionArithmetic<char, ArithmeticMultiply>::pullInternal(Column* a,
+    Column* b) {
   assert(false);
 }
 // }}}
 
 // Divide {{{
 template<class T>
-class ExpressionDivide : public Expression2<T> {
+class ExpressionDivide : public ExpressionArithmetic<T, ArithmeticDivide> {
  public:
-  ExpressionDivide(Expression* l, Expression* r): Expression2<T>(l, r) { }
+  ExpressionDivide(Expression* l, Expression* r):
+    ExpressionArithmetic<T, ArithmeticDivide>(l, r) { }
 
-  void pullInternal(Column* a, Column* b);
+  double cost() {
+    return 4.0 + this->left->cost() + this->right->cost();
+  }
 
   virtual ~ExpressionDivide() { };
 };
 
+// always floating
 template<>
 inline void
-ExpressionDivide<int>::pullInternal(Column* a, Column* b) {
+ExpressionArithmetic<int, ArithmeticDivide>::pullInternal(Column* a,
+    Column* b) {
   assert(false);
 }
 
 template<>
 inline void
-ExpressionDivide<double>::pullInternal(Column* a, Column* b) {
-  cache.size = a->size;
-  double* target = cache.chunk;
+ExpressionArithmetic<char, ArithmeticDivide>::pullInternal(Column* a,
+    Column* b) {
+  assert(false);
+}
+// }}}
 
-  if ((dynamic_cast<ColumnChunk<double>*>(a) == NULL) ^
-      (dynamic_cast<ColumnChunk<double>*>(b) == NULL)
-      ) {
-    if (dynamic_cast<ColumnChunk<double>*>(a) == NULL) {
-      swap(a, b);
+// Or, And, Not {{{
+/**
+ * Evaluates the right side only on rows the left side leaves undecided,
+ * i.e. true ones for And and false ones for Or. Sides are swapped when the
+ * observed fraction of rows each of them decides and their cost estimates
+ * show that the other order evaluates fewer expensive rows.
+ */
+class ExpressionShortCircuit : public Expression2<char> {
+  bool decidingValue; // false for And, true for Or
+  SelectionVector undecided;
+  // of left and right, halved from time to time to follow changes in data
+  double costs[2];
+  double decided[2];
+  double evaluated[2];
+
+  static bool getBit(const unsigned char* bitmap, int i) {
+    return (bitmap[i / 8] >> (i & 7)) & 1;
+  }
+
+  void record(int side, int decidedRows, int evaluatedRows) {
+    decided[side] += decidedRows;
+    evaluated[side] += evaluatedRows;
+    if (evaluated[side] > (1 << 16)) {
+      decided[side] /= 2;
+      evaluated[side] /= 2;
     }
-    double *aT = ((ColumnChunk<double>*) a)->chunk; 
-    int *bT = ((ColumnChunk<int>*) b)->chunk; 
+  }
 
-    for (int i = 0 ; i < cache.size ; ++i) {
-      target[i] = aT[i] / bT[i];
+  /** Cost per decided row, the side with the lower one should go first */
+  double rank(int side) {
+    return (costs[side] + 0.1) * (evaluated[side] + 2) / (decided[side] + 1);
+  }
+
+  void reorder() {
+    if (rank(1) < 0.8 * rank(0)) {
+      swap(left, right);
+      swap(costs[0], costs[1]);
+      swap(decided[0], decided[1]);
+      swap(evaluated[0], evaluated[1]);
     }
-  } else if (dynamic_cast<ColumnChunk<double>*>(a) == NULL &&
-      dynamic_cast<ColumnChunk<double>*>(b) == NULL
-      ) {
-    int *aT = ((ColumnChunk<int>*) a)->chunk; 
-    int *bT = ((ColumnChunk<int>*) b)->chunk; 
+  }
 
-    for (int i = 0 ; i < cache.size ; ++i) {
-      target[i] = aT[i] / ((double) bT[i]);
+  Column* evaluate(vector<Column*>* sources, const SelectionVector* selection) {
+    Column* a = selection == NULL ? left->pull(sources) :
+      left->pullSelected(sources, *selection);
+    const unsigned char* aT =
+      (const unsigned char*) static_cast<ColumnChunk<char>*>(a)->chunk;
+    int n = a->size;
+    int total = selection == NULL ? n : selection->size;
+    int count = 0;
+
+    if (selection != NULL) {
+      for (int r = 0 ; r < total ; ++r) {
+        int i = selection->rows[r];
+        undecided.rows[count] = i;
+        count += getBit(aT, i) ^ decidingValue;
+      }
+    } else if (decidingValue) {
+      unsigned char inverted[MAX_CHUNK_SIZE / 8 + 1];
+      for (int i = 0 ; i < (n + 7) / 8 ; ++i) {
+        inverted[i] = ~aT[i];
+      }
+      count = selectRows(inverted, n, undecided.rows);
+    } else {
+      count = selectRows(aT, n, undecided.rows);
+    }
+    undecided.size = count;
+    record(0, total - count, total);
+
+    if (count == 0) {
+      // every row has the value of the left side
+      reorder();
+      return a;
     }
-  } else {
-    double *aT = ((ColumnChunk<double>*) a)->chunk; 
-    double *bT = ((ColumnChunk<double>*) b)->chunk; 
 
-    for (int i = 0 ; i < cache.size ; ++i) {
-      target[i] = aT[i] / bT[i];
+    Column* b = count == n ? right->pull(sources) :
+      right->pullSelected(sources, undecided);
+    const unsigned char* bT =
+      (const unsigned char*) static_cast<ColumnChunk<char>*>(b)->chunk;
+    int decidedRight = 0;
+    for (int r = 0 ; r < count ; ++r) {
+      decidedRight += getBit(bT, undecided.rows[r]) == decidingValue;
     }
+    record(1, decidedRight, count);
+
+    // rows decided by the left side are right whatever the other bit is
+    pullInternal(a, b);
+    reorder();
+    return &cache;
   }
-}
 
-template<>
-inline void
-ExpressionDivide<char>::pullInternal(Column* a, Column* b) {
-  assert(false);
-}
-// }}}
+ protected:
+  ExpressionShortCircuit(Expression* l, Expression* r, bool deciding):
+    Expression2<char>(l, r), decidingValue(deciding) {
+    costs[0] = left->cost();
+    costs[1] = right->cost();
+    decided[0] = decided[1] = 0;
+    evaluated[0] = evaluated[1] = 0;
+  }
 
-// Or, And, Not {{{
-class ExpressionOr : public Expression2<char> {
  public:
-  ExpressionOr(Expression* l, Expression* r): Expression2<char>(l, r) { }
+  Column* pull(vector<Column*>* sources) {
+    return evaluate(sources, NULL);
+  }
+
+  Column* pullSelected(vector<Column*>* sources,
+      const SelectionVector& selection) {
+    return evaluate(sources, &selection);
+  }
+
+  virtual ~ExpressionShortCircuit() { };
+};
+
+class ExpressionOr : public ExpressionShortCircuit {
+ public:
+  ExpressionOr(Expression* l, Expression* r):
+    ExpressionShortCircuit(l, r, true) { }
   void pullInternal(Column* a, Column* b) {
     cache.size = a->size;
     char* aT = static_cast<ColumnChunk<char>*>(a)->chunk;
@@ -408,9 +525,10 @@ class ExpressionOr : public Expression2<char> {
   virtual ~ExpressionOr() { };
 };
 
-class ExpressionAnd : public Expression2<char> {
+class ExpressionAnd : public ExpressionShortCircuit {
  public:
-  ExpressionAnd(Expression* l, Expression* r): Expression2<char>(l, r) { }
+  ExpressionAnd(Expression* l, Expression* r):
+    ExpressionShortCircuit(l, r, false) { }
   void pullInternal(Column* a, Column* b) {
     cache.size = a->size;
     char* aT = static_cast<ColumnChunk<char>*>(a)->chunk;
@@ -463,6 +581,25 @@ class ExpressionLog : public Expression {
     return &cache;
   }
 
+  Column* pullSelected(vector<Column*>* sources,
+      const SelectionVector& selection) {
+    Column* a = left->pullSelected(sources, selection);
+    T* source = static_cast<ColumnChunk<T>*>(a)->chunk;
+    double* target = cache.chunk;
+    cache.size = a->size;
+
+    for (int r = 0 ; r < selection.size ; ++r) {
+      int i = selection.rows[r];
+      target[i] = log(source[i]);
+    }
+
+    return &cache;
+  }
+
+  double cost() {
+    return 20.0 + left->cost();
+  }
+
   std::ostream& debugPrint(std::ostream& output) {
     output << "ExpressionLog { " << *left;
     return output << "}";
@@ -517,6 +654,52 @@ ExpressionNegate<char>::pullInternal(Column* a) {
 // }}}
 
 // Lower, Equal, not equal {{{
+/**
+ * If one side is constant, compares the other one with its value instead
+ * of a chunk of copies. Returns false if it can't.
+ */
+template<class TL, class TR>
+inline bool compareWithConstant(Comparison op, Column* a, Column* b,
+    char* target, int n) {
+  const ChunkEncoding<TL>* aE = constantEncoding<TL>(a);
+  const ChunkEncoding<TR>* bE = constantEncoding<TR>(b);
+  if (bE != NULL) {
+    TL* aT = static_cast<ColumnChunk<TL>*>(a)->chunk;
+    switch (op) {
+      case LOWER:
+        compareColumnConstant<LOWER>(aT, bE->values[0], target, n);
+        break;
+      case EQUAL:
+        compareColumnConstant<EQUAL>(aT, bE->values[0], target, n);
+        break;
+      default:
+        compareColumnConstant<NOT_EQUAL>(aT, bE->values[0], target, n);
+    }
+  } else if (aE != NULL) {
+    TR* bT = static_cast<ColumnChunk<TR>*>(b)->chunk;
+    switch (op) {
+      case LOWER:
+        compareConstantColumn<LOWER>(aE->values[0], bT, target, n);
+        break;
+      case EQUAL:
+        compareConstantColumn<EQUAL>(aE->values[0], bT, target, n);
+        break;
+      default:
+        compareConstantColumn<NOT_EQUAL>(aE->values[0], bT, target, n);
+    }
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// bitmaps have no encodings
+template<>
+inline bool compareWithConstant<char, char>(Comparison op, Column* a,
+    Column* b, char* target, int n) {
+  return false;
+}
+
 template<class TL, class TR>
 class ExpressionLogic : public Expression {
  protected:
@@ -524,12 +707,45 @@ class ExpressionLogic : public Expression {
   Expression* right;
   ColumnChunk<char> result;
   virtual void pullLogic(TL* aT, TR* bT, char* target, int size) = 0;
+  virtual bool compareValues(TL a, TR b) = 0;
+  virtual Comparison comparison() = 0;
+
+  /**
+   * If one side is constant and the other encoded, compares distinct values
+   * only. Returns false if it can't.
+   */
+  bool pullEncoded(Column* a, Column* b) {
+    const ChunkEncoding<TL>* aE = static_cast<ColumnChunk<TL>*>(a)->encoding;
+    const ChunkEncoding<TR>* bE = static_cast<ColumnChunk<TR>*>(b)->encoding;
+    if (aE == NULL || bE == NULL) {
+      return false;
+    }
+    bool results[ENCODING_MAX_VALUES];
+    if (bE->kind == ChunkEncoding<TR>::CONSTANT) {
+      for (int k = 0 ; k < aE->size ; ++k) {
+        results[k] = compareValues(aE->values[k], bE->values[0]);
+      }
+      aE->expandBits(results, result.chunk, result.size);
+    } else if (aE->kind == ChunkEncoding<TL>::CONSTANT) {
+      for (int k = 0 ; k < bE->size ; ++k) {
+        results[k] = compareValues(aE->values[0], bE->values[k]);
+      }
+      bE->expandBits(results, result.chunk, result.size);
+    } else {
+      return false;
+    }
+    return true;
+  }
  public:
   ExpressionLogic(Expression* l, Expression* r): left(l), right(r) { }
   Column* pull(vector<Column*>* sources) {
     Column* a = left->pull(sources);
     Column* b = right->pull(sources);
     result.size = a->size;
+    if (pullEncoded(a, b) || compareWithConstant<TL, TR>(comparison(), a, b,
+          result.chunk, result.size)) {
+      return &result;
+    }
     TL* aT = static_cast<ColumnChunk<TL>*>(a)->chunk;
     TR* bT = static_cast<ColumnChunk<TR>*>(b)->chunk;
     char* target = &result.chunk[0];
@@ -537,6 +753,26 @@ class ExpressionLogic : public Expression {
     return &result;
   }
 
+  /** Comparisons are cheap, only operands are evaluated selectively */
+  Column* pullSelected(vector<Column*>* sources,
+      const SelectionVector& selection) {
+    Column* a = left->pullSelected(sources, selection);
+    Column* b = right->pullSelected(sources, selection);
+    result.size = a->size;
+    if (pullEncoded(a, b) || compareWithConstant<TL, TR>(comparison(), a, b,
+          result.chunk, result.size)) {
+      return &result;
+    }
+    TL* aT = static_cast<ColumnChunk<TL>*>(a)->chunk;
+    TR* bT = static_cast<ColumnChunk<TR>*>(b)->chunk;
+    pullLogic(aT, bT, &result.chunk[0], result.size);
+    return &result;
+  }
+
+  double cost() {
+    return 1.0 + left->cost() + right->cost();
+  }
+
   std::ostream& debugPrint(std::ostream& output) {
     return output << "ExpressionLogic { " << *left << " " << *right << "}\n";
   }
@@ -555,14 +791,13 @@ template<class TL, class TR>
 class ExpressionLower : public ExpressionLogic<TL, TR> {
  protected:
   void pullLogic(TL* aT, TR* bT, char* target, int size) {
-    int n = (size + 7) / 8;
-    for(int i = 0 ; i < n ; ++i) {
-      target[i] = 0;
-    }
-    for(int i = 0 ; i < size ; ++i) {
-      if (aT[i] < bT[i])
-        target[i / 8] |= 1 << (i & 7);
-    }
+    compareColumns<LOWER>(aT, bT, target, size);
+  }
+  bool compareValues(TL a, TR b) {
+    return a < b;
+  }
+  Comparison comparison() {
+    return LOWER;
   }
  public:
   ExpressionLower(Expression* l, Expression* r):
@@ -575,14 +810,13 @@ template<class TL, class TR>
 class ExpressionEqual : public ExpressionLogic<TL, TR> {
  protected:
   void pullLogic(TL* aT, TR* bT, char* target, int size) {
-    int n = (size + 7) / 8;
-    for(int i = 0 ; i < n ; ++i) {
-      target[i] = 0;
-    }
-    for(int i = 0 ; i < size ; ++i) {
-      if (aT[i] == bT[i])
-        target[i / 8] |= 1 << (i & 7);
-    }
+    compareColumns<EQUAL>(aT, bT, target, size);
+  }
+  bool compareValues(TL a, TR b) {
+    return a == b;
+  }
+  Comparison comparison() {
+    return EQUAL;
   }
  public:
   ExpressionEqual(Expression* l, Expression* r):
@@ -591,6 +825,15 @@ class ExpressionEqual : public ExpressionLogic<TL, TR> {
   virtual ~ExpressionEqual() { }
 };
 
+template<>
+inline void
+ExpressionLower<char, char>::pullLogic(char* aT, char* bT, char* target, int size) {
+  int n = (size + 7) / 8;
+  for(int i = 0 ; i < n ; ++i) {
+    target[i] = ~aT[i] & bT[i];
+  }
+}
+
 template<>
 inline void
 ExpressionEqual<char, char>::pullLogic(char* aT, char* bT, char* target, int size) {
@@ -604,14 +847,13 @@ template<class TL, class TR>
 class ExpressionNotEqual : public ExpressionLogic<TL, TR> {
  protected:
   void pullLogic(TL* aT, TR* bT, char* target, int size) {
-    int n = (size + 7) / 8;
-    for(int i = 0 ; i < n ; ++i) {
-      target[i] = 0;
-    }
-    for(int i = 0 ; i < size ; ++i) {
-      if (aT[i] != bT[i])
-        target[i / 8] |= 1 << (i & 7);
-    }
+    compareColumns<NOT_EQUAL>(aT, bT, target, size);
+  }
+  bool compareValues(TL a, TR b) {
+    return a != b;
+  }
+  Comparison comparison() {
+    return NOT_EQUAL;
   }
  public:
   ExpressionNotEqual(Expression* l, Expression* r):
@@ -630,6 +872,15 @@ ExpressionNotEqual<char, char>::pullLogic(char* aT, char* bT, char* target, int
 // }}}
 
 // If {{{
+// per row, for evaluating branches of an if on selected rows only
+const double IF_SELECTIVE_COST = 2.0;
+
+/**
+ * Branches are evaluated either on the rows their condition selects or on
+ * all of them, whichever the cost estimates say is cheaper: gathering rows
+ * pays off only for expensive branches. Either way results are combined
+ * with a branch-free blend.
+ */
 template<class T>
 class ExpressionIf : public Expression {
  protected:
@@ -637,69 +888,91 @@ class ExpressionIf : public Expression {
   Expression* left;
   Expression* right;
   ColumnChunk<T> result;
- public:
-  ExpressionIf(Expression* cond, Expression* l, Expression* r):
-    condition(cond), left(l), right(r) { }
+  SelectionVector trueRows;
+  SelectionVector falseRows;
+
+  /** Rows of selection (all if NULL) where condition has given value */
+  static int collect(const char* condition, int n,
+      const SelectionVector* selection, bool value, int* rows) {
+    const unsigned char* cT = (const unsigned char*) condition;
+    if (selection != NULL) {
+      int count = 0;
+      for (int r = 0 ; r < selection->size ; ++r) {
+        int i = selection->rows[r];
+        rows[count] = i;
+        count += ((cT[i / 8] >> (i & 7)) & 1) == value;
+      }
+      return count;
+    } else if (value) {
+      return selectRows(cT, n, rows);
+    } else {
+      unsigned char inverted[MAX_CHUNK_SIZE / 8 + 1];
+      for (int i = 0 ; i < (n + 7) / 8 ; ++i) {
+        inverted[i] = ~cT[i];
+      }
+      return selectRows(inverted, n, rows);
+    }
+  }
 
-  Column* pull(vector<Column*>* sources) {
-    Column* cond = condition->pull(sources);
-    unsigned char* cT = (unsigned char*) static_cast<ColumnChunk<char>*>(cond)->chunk;
-    result.size = cond->size;
-    int resultsInBytes = result.size / 8;
+  static Column* pullBranch(Expression* branch, vector<Column*>* sources,
+      const SelectionVector* selection) {
+    return selection == NULL ? branch->pull(sources) :
+      branch->pullSelected(sources, *selection);
+  }
 
-    // non empty
-    if (result.size == 0) {
+  Column* evaluate(vector<Column*>* sources, const SelectionVector* selection) {
+    Column* cond = pullBranch(condition, sources, selection);
+    char* cT = static_cast<ColumnChunk<char>*>(cond)->chunk;
+    int n = result.size = cond->size;
+    int total = selection == NULL ? n : selection->size;
+
+    if (total == 0) {
       return &result;
     }
 
-    // check if whole block has one value
-    if (cT[0] & 1) {
-      for (int i = 0 ; i < resultsInBytes ; ++i) {
-        if (cT[i] != 0xff) {
-          goto has_true_and_false;
-        }
-      }
-      for (int i = resultsInBytes * 8 ; i < result.size ; ++i) {
-        if ((cT[i / 8] & (1 << (i & 7))) == 0) {
-          goto has_true_and_false;
-        }
-      }
+    trueRows.size = collect(cT, n, selection, true, trueRows.rows);
+    if (trueRows.size == total) {
+      return pullBranch(left, sources, selection);
+    } else if (trueRows.size == 0) {
+      return pullBranch(right, sources, selection);
+    }
 
-      Column* a = left->pull(sources);
-      return a;
+    double leftCost = left->cost();
+    double rightCost = right->cost();
+    double selectiveCost = leftCost * trueRows.size +
+      rightCost * (total - trueRows.size) + IF_SELECTIVE_COST * total;
+    Column* a;
+    Column* b;
+    if (selectiveCost < (leftCost + rightCost) * total) {
+      falseRows.size = collect(cT, n, selection, false, falseRows.rows);
+      a = left->pullSelected(sources, trueRows);
+      b = right->pullSelected(sources, falseRows);
     } else {
-      for (int i = 0 ; i < resultsInBytes ; ++i) {
-        if (cT[i] != 0x00) {
-          goto has_true_and_false;
-        }
-      }
-      for (int i = resultsInBytes * 8 ; i < result.size ; ++i) {
-        if (cT[i / 8] & (1 << (i & 7))) {
-          goto has_true_and_false;
-        }
-      }
-
-      Column* b = right->pull(sources);
-      return b;
+      a = pullBranch(left, sources, selection);
+      b = pullBranch(right, sources, selection);
     }
 
-has_true_and_false:
+    // a is valid on true rows and b on false ones, exactly what is blended
+    blendColumns(cT, static_cast<ColumnChunk<T>*>(a)->chunk,
+        static_cast<ColumnChunk<T>*>(b)->chunk, result.chunk, n);
+    return &result;
+  }
 
-    Column* a = left->pull(sources);
-    Column* b = right->pull(sources);
-    T* aT = static_cast<ColumnChunk<T>*>(a)->chunk;
-    T* bT = static_cast<ColumnChunk<T>*>(b)->chunk;
-    T* target = &result.chunk[0];
-
-    for (int i = 0 ; i < result.size ; ++i) {
-      if (cT[i / 8] & (1 << (i & 7))) {
-        target[i] = aT[i];
-      } else {
-        target[i] = bT[i];
-      }
-    }
+ public:
+  ExpressionIf(Expression* cond, Expression* l, Expression* r):
+    condition(cond), left(l), right(r) { }
 
-    return &result;
+  Column* pull(vector<Column*>* sources) {
+    return evaluate(sources, NULL);
+  }
+
+  Column* pullSelected(vector<Column*>* sources,
+      const SelectionVector& selection) {
+    return evaluate(sources, &selection);
+  }
+
+  double cost() {
+    return 1.0 + condition->cost() + left->cost() + right->cost();
   }
 
   std::ostream& debugPrint(std::ostream& output) {
@@ -722,4 +995,128 @@ has_true_and_false:
 // }}}
 
 
+// Shared {{{
+class ExpressionShared;
+
+/**
+ * Identical subexpressions of an operation, see Factory::createExpression.
+ * Expressions are registered with addUses before any is created. The
+ * operation calls nextChunk before it evaluates its expressions, so shared
+ * ones are evaluated once per chunk.
+ */
+class ExpressionContext {
+  std::map<string, int> uses;
+  std::map<string, ExpressionShared*> shared;
+  int generation;
+ public:
+  ExpressionContext(): generation(0) { }
+
+  /** Counts the expression and its subexpressions */
+  void addUses(const query::Expression& expression) {
+    uses[expression.SerializeAsString()]++;
+    for (int i = 0 ; i < expression.children_size() ; ++i) {
+      addUses(expression.children(i));
+    }
+  }
+
+  /** Used more than once and not trivial */
+  bool isShared(const query::Expression& expression) {
+    if (expression.operator_() == query::Expression::COLUMN ||
+        expression.operator_() == query::Expression::CONSTANT) {
+      return false;
+    }
+    std::map<string, int>::iterator it = uses.find(expression.SerializeAsString());
+    return it != uses.end() && it->second > 1;
+  }
+
+  ExpressionShared* find(const query::Expression& expression) {
+    std::map<string, ExpressionShared*>::iterator it =
+      shared.find(expression.SerializeAsString());
+    return it == shared.end() ? NULL : it->second;
+  }
+
+  void add(const query::Expression& expression, ExpressionShared* node) {
+    shared[expression.SerializeAsString()] = node;
+  }
+
+  void nextChunk() {
+    ++generation;
+  }
+
+  int getGeneration() {
+    return generation;
+  }
+
+  ~ExpressionContext();
+};
+
+/** Owned by the context, consumers use it through ExpressionReference */
+class ExpressionShared : public Expression {
+  Expression* expression;
+  ExpressionContext* context;
+  int generation; // of the cached result
+  Column* result;
+ public:
+  ExpressionShared(Expression* expression_, ExpressionContext* context_):
+    expression(expression_), context(context_), generation(-1),
+    result(NULL) { }
+
+  Column* pull(vector<Column*>* sources) {
+    if (generation != context->getGeneration()) {
+      result = expression->pull(sources);
+      generation = context->getGeneration();
+    }
+    return result;
+  }
+
+  double cost() {
+    return expression->cost();
+  }
+
+  query::ColumnType getType() {
+    return expression->getType();
+  }
+
+  std::ostream& debugPrint(std::ostream& output) {
+    return output << *expression;
+  }
+
+  virtual ~ExpressionShared() {
+    delete expression;
+  }
+};
+
+class ExpressionReference : public Expression {
+  ExpressionShared* shared;
+ public:
+  ExpressionReference(ExpressionShared* shared_): shared(shared_) { }
+
+  Column* pull(vector<Column*>* sources) {
+    return shared->pull(sources);
+  }
+
+  double cost() {
+    return shared->cost();
+  }
+
+  query::ColumnType getType() {
+    return shared->getType();
+  }
+
+  std::ostream& debugPrint(std::ostream& output) {
+    return output << "Shared(" << *shared << ")";
+  }
+
+  virtual ~ExpressionReference() { };
+};
+
+inline ExpressionContext::~ExpressionContext() {
+  for (std::map<string, ExpressionShared*>::iterator it = shared.begin() ;
+      it != shared.end() ; ++it) {
+    delete it->second;
+  }
+}
+// }}}
+
+
 #endif
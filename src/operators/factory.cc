@@ -6,11 +6,18 @@
 #include <algorithm>
 
 #include "operation.h"
+#include "fused.h"
 #include "column.h"
 
 using std::max;
 
 Server* Factory::server;
+int Factory::groupByThreads = 1;
+
+namespace global {
+  int chunkSize = DEFAULT_CHUNK_SIZE;
+  size_t groupByMemoryLimit = DEFAULT_GROUP_BY_MEMORY_LIMIT;
+}
 
 Operation*
 Factory::createOperation(const query::Operation& operation) {
@@ -23,7 +30,7 @@ Factory::createOperation(const query::Operation& operation) {
   } else if (operation.has_filter()) {
     return new FilterOperation(operation.filter());
   } else if (operation.has_group_by()) {
-    return new GroupByOperation(operation.group_by());
+    return createGroupByOperation(operation.group_by());
   } else if (operation.has_shuffle()) {
     return new ShuffleOperation(operation.shuffle());
   } else if (operation.has_union_()) {
@@ -37,6 +44,46 @@ Factory::createOperation(const query::Operation& operation) {
   }
 }
 
+Operation*
+Factory::createGroupByOperation(const query::GroupByOperation& oper) {
+  Operation* source = createOperation(oper.source());
+  vector<query::ColumnType> types = source->getTypes();
+  vector<query::ColumnType> keyTypes;
+  for (int i = 0 ; i < oper.group_by_column_size() ; ++i) {
+    keyTypes.push_back(types[oper.group_by_column(i)]);
+  }
+
+  if (oper.source().has_union_() && !oper.partial() && groupByThreads > 1) {
+    UnionOperation* unionSource = static_cast<UnionOperation*>(source);
+    switch (GroupByOperation::chooseKeyLayout(keyTypes)) {
+      case GroupByOperation::INT32_KEY:
+        return new ParallelGroupByOperation<Int32KeyLayout>(oper, unionSource,
+            groupByThreads);
+      case GroupByOperation::PACKED_KEY:
+        return new ParallelGroupByOperation<PackedKeyLayout>(oper, unionSource,
+            groupByThreads);
+      case GroupByOperation::GENERIC_KEY:
+        return new ParallelGroupByOperation<GenericKeyLayout>(oper, unionSource,
+            groupByThreads);
+      default:
+        assert(false);
+        return NULL;
+    }
+  }
+
+  switch (GroupByOperation::chooseKeyLayout(keyTypes)) {
+    case GroupByOperation::INT32_KEY:
+      return new GroupByOperationImpl<Int32KeyLayout>(oper, source);
+    case GroupByOperation::PACKED_KEY:
+      return new GroupByOperationImpl<PackedKeyLayout>(oper, source);
+    case GroupByOperation::GENERIC_KEY:
+      return new GroupByOperationImpl<GenericKeyLayout>(oper, source);
+    default:
+      assert(false);
+      return NULL;
+  }
+}
+
 ColumnProvider*
 Factory::createColumnProvider(int columnId, query::ColumnType type) {
   switch (type) {
@@ -135,47 +182,48 @@ static int findType(
 // createExpressionImpl {{{
 template<class T>
 static Expression* createExpressionImpl(
-    const query::Expression& expression, vector<query::ColumnType>& providers) {
+    const query::Expression& expression, vector<query::ColumnType>& providers,
+    ExpressionContext* context) {
   switch (expression.operator_()) {
     case query::Expression::COLUMN:
       return new ExpressionColumn<T>(expression.column_id());
     case query::Expression::ADD:
       return new ExpressionAdd<T>(
-          Factory::createExpression(expression.children().Get(0), providers),
-          Factory::createExpression(expression.children().Get(1), providers)
+          Factory::createExpression(expression.children().Get(0), providers, context),
+          Factory::createExpression(expression.children().Get(1), providers, context)
           );
     case query::Expression::SUBTRACT:
       return new ExpressionMinus<T>(
-          Factory::createExpression(expression.children().Get(0), providers),
-          Factory::createExpression(expression.children().Get(1), providers)
+          Factory::createExpression(expression.children().Get(0), providers, context),
+          Factory::createExpression(expression.children().Get(1), providers, context)
           );
     case query::Expression::MULTIPLY:
       return new ExpressionMultiply<T>(
-          Factory::createExpression(expression.children().Get(0), providers),
-          Factory::createExpression(expression.children().Get(1), providers)
+          Factory::createExpression(expression.children().Get(0), providers, context),
+          Factory::createExpression(expression.children().Get(1), providers, context)
           );
     case query::Expression::FLOATING_DIVIDE:
       return new ExpressionDivide<T>(
-          Factory::createExpression(expression.children().Get(0), providers),
-          Factory::createExpression(expression.children().Get(1), providers)
+          Factory::createExpression(expression.children().Get(0), providers, context),
+          Factory::createExpression(expression.children().Get(1), providers, context)
           );
     case query::Expression::AND:
       return new ExpressionAnd(
-          Factory::createExpression(expression.children().Get(0), providers),
-          Factory::createExpression(expression.children().Get(1), providers)
+          Factory::createExpression(expression.children().Get(0), providers, context),
+          Factory::createExpression(expression.children().Get(1), providers, context)
           );
     case query::Expression::OR:
       return new ExpressionOr(
-          Factory::createExpression(expression.children().Get(0), providers),
-          Factory::createExpression(expression.children().Get(1), providers)
+          Factory::createExpression(expression.children().Get(0), providers, context),
+          Factory::createExpression(expression.children().Get(1), providers, context)
           );
     case query::Expression::NOT:
       return new ExpressionNot(
-          Factory::createExpression(expression.children().Get(0), providers)
+          Factory::createExpression(expression.children().Get(0), providers, context)
           );
     case query::Expression::NEGATE:
       return new ExpressionNegate<T>(
-          Factory::createExpression(expression.children().Get(0), providers)
+          Factory::createExpression(expression.children().Get(0), providers, context)
           );
     case query::Expression::LOWER:
     case query::Expression::GREATER:
@@ -185,13 +233,13 @@ static Expression* createExpressionImpl(
       return NULL;
     case query::Expression::IF:
       return new ExpressionIf<T>(
-          Factory::createExpression(expression.children().Get(0), providers),
-          Factory::createExpression(expression.children().Get(1), providers),
-          Factory::createExpression(expression.children().Get(2), providers)
+          Factory::createExpression(expression.children().Get(0), providers, context),
+          Factory::createExpression(expression.children().Get(1), providers, context),
+          Factory::createExpression(expression.children().Get(2), providers, context)
           );
     case query::Expression::LOG:
       return new ExpressionLog<T>(
-          Factory::createExpression(expression.children().Get(0), providers)
+          Factory::createExpression(expression.children().Get(0), providers, context)
           );
     case query::Expression::CONSTANT:
       if (expression.has_constant_int32()) {
@@ -210,13 +258,132 @@ static Expression* createExpressionImpl(
 }
 // }}}
 
+// Fused expressions {{{
+/**
+ * Whether expression can be an operator of a fused program. Comparisons
+ * produce bitmaps, so they can be only the root. Shared subexpressions are
+ * evaluated once by their own node.
+ */
+static bool canFuse(const query::Expression& expression,
+    const vector<query::ColumnType>& providers, ExpressionContext* context,
+    bool root) {
+  if (!root && context != NULL && context->isShared(expression)) {
+    return false;
+  }
+  switch (expression.operator_()) {
+    case query::Expression::LOWER:
+    case query::Expression::GREATER:
+    case query::Expression::EQUAL:
+    case query::Expression::NOT_EQUAL:
+      if (!root) {
+        return false;
+      }
+      break;
+    case query::Expression::ADD:
+    case query::Expression::SUBTRACT:
+    case query::Expression::MULTIPLY:
+    case query::Expression::FLOATING_DIVIDE:
+    case query::Expression::NEGATE:
+      break;
+    default:
+      return false;
+  }
+  for (int i = 0 ; i < expression.children_size() ; ++i) {
+    int type = findType(expression.children(i), providers);
+    if (type != query::INT && type != query::DOUBLE) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/** Number of operators a fused program of the expression would have */
+static int countFused(const query::Expression& expression,
+    const vector<query::ColumnType>& providers, ExpressionContext* context,
+    bool root) {
+  if (!canFuse(expression, providers, context, root)) {
+    return 0;
+  }
+  int result = 1;
+  for (int i = 0 ; i < expression.children_size() ; ++i) {
+    result += countFused(expression.children(i), providers, context, false);
+  }
+  return result;
+}
+
+template<class T>
+static FusedKernel chooseFusedKernel(query::Expression::Operator op,
+    query::ColumnType a, query::ColumnType b) {
+  switch (op) {
+    case query::Expression::ADD:
+      return fusedArithmetic<ArithmeticAdd<T>, T>(a, b);
+    case query::Expression::SUBTRACT:
+      return fusedArithmetic<ArithmeticSubtract<T>, T>(a, b);
+    case query::Expression::MULTIPLY:
+      return fusedArithmetic<ArithmeticMultiply<T>, T>(a, b);
+    case query::Expression::FLOATING_DIVIDE:
+      return fusedArithmetic<ArithmeticDivide<T>, T>(a, b);
+    case query::Expression::NEGATE:
+      return fusedArithmetic<ArithmeticNegate<T>, T>(a, b);
+    default:
+      assert(false);
+      return NULL;
+  }
+}
+
+/** Adds expression to the program, returns slot of its value */
+static int addFused(const query::Expression& expression,
+    vector<query::ColumnType>& providers, ExpressionContext* context,
+    FusedExpression* fused, bool root) {
+  if (!canFuse(expression, providers, context, root)) {
+    return fused->addLeaf(
+        Factory::createExpression(expression, providers, context));
+  }
+
+  query::Expression::Operator op = expression.operator_();
+  int a, b;
+  if (op == query::Expression::GREATER) {
+    a = addFused(expression.children(1), providers, context, fused, false);
+    b = addFused(expression.children(0), providers, context, fused, false);
+  } else {
+    a = addFused(expression.children(0), providers, context, fused, false);
+    b = expression.children_size() > 1 ?
+      addFused(expression.children(1), providers, context, fused, false) : a;
+  }
+  query::ColumnType typeA = fused->slotType(a);
+  query::ColumnType typeB = fused->slotType(b);
+
+  switch (op) {
+    case query::Expression::LOWER:
+    case query::Expression::GREATER:
+      return fused->addInstruction(fusedComparison<LOWER>(typeA, typeB), a, b,
+          query::BOOL);
+    case query::Expression::EQUAL:
+      return fused->addInstruction(fusedComparison<EQUAL>(typeA, typeB), a, b,
+          query::BOOL);
+    case query::Expression::NOT_EQUAL:
+      return fused->addInstruction(fusedComparison<NOT_EQUAL>(typeA, typeB),
+          a, b, query::BOOL);
+    default:
+      if (findType(expression, providers) == query::INT) {
+        return fused->addInstruction(chooseFusedKernel<int>(op, typeA, typeB),
+            a, b, query::INT);
+      } else {
+        return fused->addInstruction(
+            chooseFusedKernel<double>(op, typeA, typeB), a, b, query::DOUBLE);
+      }
+  }
+}
+// }}}
+
 template<class TL, class TR>
 static Expression* createExpressionLogic(
-    const query::Expression& expression, vector<query::ColumnType>& providers) {
+    const query::Expression& expression, vector<query::ColumnType>& providers,
+    ExpressionContext* context) {
   Expression* left =
-    Factory::createExpression(expression.children().Get(0), providers);
+    Factory::createExpression(expression.children().Get(0), providers, context);
   Expression* right =
-    Factory::createExpression(expression.children().Get(1), providers);
+    Factory::createExpression(expression.children().Get(1), providers, context);
 
   if (expression.operator_() == query::Expression::GREATER) {
     return new ExpressionLower<TR, TL>(right, left);
@@ -232,9 +399,19 @@ static Expression* createExpressionLogic(
 }
 
 
-Expression*
-Factory::createExpression(
-    const query::Expression& expression, vector<query::ColumnType>& providers) {
+static Expression* createExpressionUnshared(
+    const query::Expression& expression, vector<query::ColumnType>& providers,
+    ExpressionContext* context) {
+  // a single operator gains nothing from fusing
+  if (countFused(expression, providers, context, true) >= 2) {
+    // comparisons are the only operators fused at the root only
+    query::ColumnType type = canFuse(expression, providers, NULL, false) ?
+      (query::ColumnType) findType(expression, providers) : query::BOOL;
+    FusedExpression* fused = new FusedExpression(type);
+    addFused(expression, providers, context, fused, true);
+    return fused;
+  }
+
   if (expression.operator_() == query::Expression::GREATER ||
       expression.operator_() == query::Expression::LOWER ||
       expression.operator_() == query::Expression::EQUAL ||
@@ -243,15 +420,15 @@ Factory::createExpression(
     int rightType = findType(expression.children().Get(1), providers);
     switch (100 * leftType + rightType) {
       case (query::INT * 100 + query::INT):
-        return createExpressionLogic<int, int>(expression, providers);
+        return createExpressionLogic<int, int>(expression, providers, context);
       case (query::DOUBLE * 100 + query::DOUBLE): 
-        return createExpressionLogic<double, double>(expression, providers);
+        return createExpressionLogic<double, double>(expression, providers, context);
       case (query::INT * 100 + query::DOUBLE):
-        return createExpressionLogic<int, double>(expression, providers);
+        return createExpressionLogic<int, double>(expression, providers, context);
       case (query::DOUBLE * 100 + query::INT):
-        return createExpressionLogic<double, int>(expression, providers);
+        return createExpressionLogic<double, int>(expression, providers, context);
       case (query::BOOL * 100 + query::BOOL):
-        return createExpressionLogic<char, char>(expression, providers);
+        return createExpressionLogic<char, char>(expression, providers, context);
       default:
         assert(false); // unknown combination
         return NULL;
@@ -260,13 +437,244 @@ Factory::createExpression(
   }
   switch (findType(expression, providers)) {
     case 1:
-      return createExpressionImpl<int>(expression, providers);
+      return createExpressionImpl<int>(expression, providers, context);
     case 2:
-      return createExpressionImpl<double>(expression, providers);
+      return createExpressionImpl<double>(expression, providers, context);
     case 3:
-      return createExpressionImpl<char>(expression, providers);
+      return createExpressionImpl<char>(expression, providers, context);
     default:
       assert(false);
       return NULL;
   }
 }
+
+Expression*
+Factory::createExpression(const query::Expression& expression,
+    vector<query::ColumnType>& providers, ExpressionContext* context) {
+  if (context == NULL || !context->isShared(expression)) {
+    return createExpressionUnshared(expression, providers, context);
+  }
+  ExpressionShared* shared = context->find(expression);
+  if (shared == NULL) {
+    shared = new ExpressionShared(
+        createExpressionUnshared(expression, providers, context), context);
+    context->add(expression, shared);
+  }
+  return new ExpressionReference(shared);
+}
+
+// simplifyExpression {{{
+static bool isConstant(const query::Expression& expression) {
+  return expression.operator_() == query::Expression::CONSTANT;
+}
+
+static double constantValue(const query::Expression& expression) {
+  if (expression.has_constant_int32()) {
+    return expression.constant_int32();
+  } else if (expression.has_constant_double()) {
+    return expression.constant_double();
+  } else {
+    return expression.constant_bool();
+  }
+}
+
+static bool isConstant(const query::Expression& expression, double value) {
+  return isConstant(expression) && !expression.has_constant_bool() &&
+    constantValue(expression) == value;
+}
+
+static bool isConstant(const query::Expression& expression, bool value) {
+  return isConstant(expression) && expression.has_constant_bool() &&
+    expression.constant_bool() == value;
+}
+
+static query::Expression makeConstant(int type, double value) {
+  query::Expression result;
+  result.set_operator_(query::Expression::CONSTANT);
+  if (type == query::INT) {
+    result.set_constant_int32((int) value);
+  } else if (type == query::DOUBLE) {
+    result.set_constant_double(value);
+  } else {
+    result.set_constant_bool(value != 0);
+  }
+  return result;
+}
+
+/** Integer arithmetic wrapping around like the evaluated one */
+static int foldInt(query::Expression::Operator op, int a, int b) {
+  switch (op) {
+    case query::Expression::ADD:
+      return (int) ((unsigned) a + (unsigned) b);
+    case query::Expression::SUBTRACT:
+      return (int) ((unsigned) a - (unsigned) b);
+    case query::Expression::MULTIPLY:
+      return (int) ((unsigned) a * (unsigned) b);
+    default:
+      assert(false);
+      return 0;
+  }
+}
+
+/** Expression with all children constant, returns false if can't fold */
+static bool fold(const query::Expression& expression,
+    const vector<query::ColumnType>& providers, query::Expression* result) {
+  query::Expression::Operator op = expression.operator_();
+  int type = findType(expression, providers);
+  vector<double> values;
+  for (int i = 0 ; i < expression.children_size() ; ++i) {
+    values.push_back(constantValue(expression.children(i)));
+  }
+
+  switch (op) {
+    case query::Expression::ADD:
+    case query::Expression::SUBTRACT:
+    case query::Expression::MULTIPLY:
+      if (type == query::INT) {
+        *result = makeConstant(type, foldInt(op,
+              expression.children(0).constant_int32(),
+              expression.children(1).constant_int32()));
+        return true;
+      } else if (type == query::DOUBLE) {
+        double value = op == query::Expression::ADD ? values[0] + values[1] :
+          op == query::Expression::SUBTRACT ? values[0] - values[1] :
+          values[0] * values[1];
+        *result = makeConstant(type, value);
+        return true;
+      }
+      return false;
+    case query::Expression::FLOATING_DIVIDE:
+      *result = makeConstant(query::DOUBLE, values[0] / values[1]);
+      return true;
+    case query::Expression::NEGATE:
+      if (type == query::INT) {
+        *result = makeConstant(type, foldInt(query::Expression::SUBTRACT, 0,
+              expression.children(0).constant_int32()));
+      } else {
+        *result = makeConstant(type, -values[0]);
+      }
+      return true;
+    case query::Expression::LOWER:
+      *result = makeConstant(query::BOOL, values[0] < values[1]);
+      return true;
+    case query::Expression::GREATER:
+      *result = makeConstant(query::BOOL, values[0] > values[1]);
+      return true;
+    case query::Expression::EQUAL:
+      *result = makeConstant(query::BOOL, values[0] == values[1]);
+      return true;
+    case query::Expression::NOT_EQUAL:
+      *result = makeConstant(query::BOOL, values[0] != values[1]);
+      return true;
+    case query::Expression::NOT:
+      *result = makeConstant(query::BOOL, !values[0]);
+      return true;
+    case query::Expression::AND:
+      *result = makeConstant(query::BOOL, values[0] && values[1]);
+      return true;
+    case query::Expression::OR:
+      *result = makeConstant(query::BOOL, values[0] || values[1]);
+      return true;
+    case query::Expression::LOG:
+      // the evaluated type of LOG is double, whatever findType says
+      if (type == query::DOUBLE) {
+        *result = makeConstant(type, log(values[0]));
+        return true;
+      }
+      return false;
+    default:
+      return false;
+  }
+}
+
+/** Expression with simplified children */
+static query::Expression simplifyNode(const query::Expression& expression,
+    const vector<query::ColumnType>& providers) {
+  bool constant = expression.children_size() > 0;
+  for (int i = 0 ; i < expression.children_size() ; ++i) {
+    constant = constant && isConstant(expression.children(i));
+  }
+  query::Expression result;
+  if (constant && fold(expression, providers, &result)) {
+    return result;
+  }
+
+  // identities, as long as they don't change the type
+  int type = findType(expression, providers);
+  const query::Expression* left = expression.children_size() > 0 ?
+    &expression.children(0) : NULL;
+  const query::Expression* right = expression.children_size() > 1 ?
+    &expression.children(1) : NULL;
+  const query::Expression* same = NULL;
+  switch (expression.operator_()) {
+    case query::Expression::ADD:
+      if (isConstant(*right, 0.0)) {
+        same = left;
+      } else if (isConstant(*left, 0.0)) {
+        same = right;
+      }
+      break;
+    case query::Expression::SUBTRACT:
+      if (isConstant(*right, 0.0)) {
+        same = left;
+      }
+      break;
+    case query::Expression::MULTIPLY:
+      if (isConstant(*right, 1.0)) {
+        same = left;
+      } else if (isConstant(*left, 1.0)) {
+        same = right;
+      }
+      break;
+    case query::Expression::FLOATING_DIVIDE:
+      if (isConstant(*right, 1.0)) {
+        same = left;
+      }
+      break;
+    case query::Expression::NOT:
+      // always boolean, findType of comparisons is the type of arguments
+      if (left->operator_() == query::Expression::NOT) {
+        return left->children(0);
+      }
+      break;
+    case query::Expression::AND:
+      if (isConstant(*right, true)) {
+        same = left;
+      } else if (isConstant(*left, true)) {
+        same = right;
+      }
+      break;
+    case query::Expression::OR:
+      if (isConstant(*right, false)) {
+        same = left;
+      } else if (isConstant(*left, false)) {
+        same = right;
+      }
+      break;
+    case query::Expression::IF:
+      if (isConstant(*left, true)) {
+        same = right;
+      } else if (isConstant(*left, false)) {
+        same = &expression.children(2);
+      }
+      break;
+    default:
+      break;
+  }
+  if (same != NULL && findType(*same, providers) == type) {
+    return *same;
+  }
+  return expression;
+}
+
+query::Expression
+Factory::simplifyExpression(const query::Expression& expression,
+    const vector<query::ColumnType>& providers) {
+  query::Expression result = expression;
+  for (int i = 0 ; i < result.children_size() ; ++i) {
+    *result.mutable_children(i) =
+      simplifyExpression(expression.children(i), providers);
+  }
+  return simplifyNode(result, providers);
+}
+// }}}
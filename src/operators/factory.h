@@ -17,17 +17,31 @@ class Operation;
 class ColumnProvider;
 class Expression;
 class Column;
+class ExpressionContext;
 
 class Factory {
  public:
   static Server* server;
+  /** Threads aggregating received rows in group by, 1 disables it */
+  static int groupByThreads;
   static Operation* createOperation(const query::Operation& operation);
+  /** Picks group by specialization matching key columns types */
+  static Operation* createGroupByOperation(const query::GroupByOperation& oper);
   static ColumnProvider* createColumnProvider(int columnId, query::ColumnType type);
   static ColumnProvider* createFileColumnProvider(DataSourceInterface** source,
       int columnId, query::ColumnType type);
   static Column* createColumnFromType(query::ColumnType type);
+  /**
+   * Subexpressions used more than once in the context are created once
+   * and shared.
+   */
   static Expression* createExpression(
-      const query::Expression& expression, vector<query::ColumnType>& providers);
+      const query::Expression& expression, vector<query::ColumnType>& providers,
+      ExpressionContext* context = NULL);
+  /** Folds constants and drops identities like x * 1, NOT NOT x */
+  static query::Expression simplifyExpression(
+      const query::Expression& expression,
+      const vector<query::ColumnType>& providers);
 };
 
 #endif
@@ -0,0 +1,230 @@
+// Fast And Furious column database
+// Author: Jacek Migdal <jacek@migdal.pl>
+
+#ifndef FUSED_H
+#define FUSED_H
+
+#include <vector>
+
+#include "expression.h"
+#include "comparison.h"
+
+using std::vector;
+
+const int FUSED_BLOCK = 64; // in rows, multiple of 8
+
+/**
+ * Evaluates one operator of a fused expression for a block of rows.
+ * Operands are converted to the type of the operator, just like the node
+ * at a time evaluator does.
+ */
+typedef void (*FusedKernel)(const void* a, const void* b, void* out, int n);
+
+// Kernels {{{
+template<class Op, class T, class TA, class TB>
+void fusedArithmeticKernel(const void* a, const void* b, void* out, int n) {
+  const TA* aT = static_cast<const TA*>(a);
+  const TB* bT = static_cast<const TB*>(b);
+  T* target = static_cast<T*>(out);
+  for (int i = 0 ; i < n ; ++i) {
+    target[i] = Op::apply((T) aT[i], (T) bT[i]);
+  }
+}
+
+/** out is the byte of the result bitmap where the block starts */
+template<Comparison op, class TA, class TB>
+void fusedComparisonKernel(const void* a, const void* b, void* out, int n) {
+  compareColumns<op>(static_cast<const TA*>(a), static_cast<const TB*>(b),
+      static_cast<char*>(out), n);
+}
+
+/** Kernel of an arithmetic operator for given types of operands */
+template<class Op, class T>
+FusedKernel fusedArithmetic(query::ColumnType a, query::ColumnType b) {
+  if (a == query::INT) {
+    return b == query::INT ? fusedArithmeticKernel<Op, T, int, int> :
+      fusedArithmeticKernel<Op, T, int, double>;
+  } else {
+    return b == query::INT ? fusedArithmeticKernel<Op, T, double, int> :
+      fusedArithmeticKernel<Op, T, double, double>;
+  }
+}
+
+template<Comparison op>
+FusedKernel fusedComparison(query::ColumnType a, query::ColumnType b) {
+  if (a == query::INT) {
+    return b == query::INT ? fusedComparisonKernel<op, int, int> :
+      fusedComparisonKernel<op, int, double>;
+  } else {
+    return b == query::INT ? fusedComparisonKernel<op, double, int> :
+      fusedComparisonKernel<op, double, double>;
+  }
+}
+// }}}
+
+/**
+ * Arithmetic (and optionally a comparison on top) of a whole subtree
+ * evaluated a block of FUSED_BLOCK rows at a time, so that intermediate
+ * values stay in small registers instead of chunk sized caches. Operands
+ * which can't be fused are leaves evaluated node at a time. Programs are
+ * built by Factory::createExpression.
+ */
+class FusedExpression : public Expression {
+  struct Instruction {
+    FusedKernel kernel;
+    int a, b; // slots of operands
+  };
+
+  vector<Expression*> leaves;
+  vector<int> leafSlots;
+  vector<query::ColumnType> types; // of slots
+  vector<Instruction> program; // result of the last one is the result
+  vector<int> resultSlots; // of instructions
+  vector<double> registers; // FUSED_BLOCK per instruction
+  vector<const char*> data; // position of each slot in the current block
+  vector<Column*> columns; // of leaves
+  vector<int> strides; // in bytes per row of leaves, 0 for constant ones
+  query::ColumnType type;
+  Column* result;
+
+  static const char* chunkData(Column* column, query::ColumnType type) {
+    if (type == query::INT) {
+      return (const char*) static_cast<ColumnChunk<int>*>(column)->chunk;
+    } else if (type == query::DOUBLE) {
+      return (const char*) static_cast<ColumnChunk<double>*>(column)->chunk;
+    } else {
+      return static_cast<ColumnChunk<char>*>(column)->chunk;
+    }
+  }
+
+  static int chunkCapacity(Column* column, query::ColumnType type) {
+    if (type == query::INT) {
+      return static_cast<ColumnChunk<int>*>(column)->capacity;
+    } else if (type == query::DOUBLE) {
+      return static_cast<ColumnChunk<double>*>(column)->capacity;
+    } else {
+      return static_cast<ColumnChunk<char>*>(column)->capacity;
+    }
+  }
+
+ public:
+  FusedExpression(query::ColumnType type_): type(type_) {
+    result = Factory::createColumnFromType(type);
+  }
+
+  /** Returns slot of the leaf value */
+  int addLeaf(Expression* leaf) {
+    leaves.push_back(leaf);
+    leafSlots.push_back(types.size());
+    types.push_back(leaf->getType());
+    return types.size() - 1;
+  }
+
+  /** Returns slot of the result, the last instruction added is the root */
+  int addInstruction(FusedKernel kernel, int a, int b, query::ColumnType type) {
+    Instruction instruction = { kernel, a, b };
+    program.push_back(instruction);
+    resultSlots.push_back(types.size());
+    types.push_back(type);
+    return types.size() - 1;
+  }
+
+  query::ColumnType slotType(int slot) {
+    return types[slot];
+  }
+
+  Column* pull(vector<Column*>* sources) {
+    return evaluate(sources, NULL);
+  }
+
+  /** Leaves are evaluated selectively, the program on the whole chunk */
+  Column* pullSelected(vector<Column*>* sources,
+      const SelectionVector& selection) {
+    return evaluate(sources, &selection);
+  }
+
+  double cost() {
+    double sum = program.size();
+    for (unsigned i = 0 ; i < leaves.size() ; ++i) {
+      sum += leaves[i]->cost();
+    }
+    return sum;
+  }
+
+  query::ColumnType getType() {
+    return type;
+  }
+
+  std::ostream& debugPrint(std::ostream& output) {
+    output << "FusedExpression(" << program.size() << " operators; ";
+    for (unsigned i = 0 ; i < leaves.size() ; ++i) {
+      output << *leaves[i] << ", ";
+    }
+    return output << ")";
+  }
+
+  virtual ~FusedExpression() {
+    for (unsigned i = 0 ; i < leaves.size() ; ++i) {
+      delete leaves[i];
+    }
+    delete result;
+  }
+
+ private:
+  Column* evaluate(vector<Column*>* sources, const SelectionVector* selection) {
+    int nLeaves = leaves.size();
+    if (registers.empty()) {
+      registers.resize(program.size() * FUSED_BLOCK);
+      data.resize(types.size());
+      columns.resize(nLeaves);
+      strides.resize(nLeaves);
+      for (unsigned k = 0 ; k < program.size() ; ++k) {
+        data[resultSlots[k]] = (const char*) &registers[k * FUSED_BLOCK];
+      }
+    }
+
+    int n = 0;
+    for (int i = 0 ; i < nLeaves ; ++i) {
+      columns[i] = selection == NULL ? leaves[i]->pull(sources) :
+        leaves[i]->pullSelected(sources, *selection);
+      n = columns[i]->size;
+      // every block of a constant reads the same first rows
+      query::ColumnType leafType = types[leafSlots[i]];
+      bool constant = leafType == query::INT ?
+        constantEncoding<int>(columns[i]) != NULL :
+        constantEncoding<double>(columns[i]) != NULL;
+      strides[i] = constant ? 0 : global::getTypeSize(leafType);
+    }
+    // constants and the result are filled up to global::chunkSize of the
+    // time they were built, it mustn't grow since
+    for (int i = 0 ; i < nLeaves ; ++i) {
+      assert(strides[i] != 0 ||
+          n <= chunkCapacity(columns[i], types[leafSlots[i]]));
+    }
+    assert(n <= chunkCapacity(result, type));
+    result->size = n;
+
+    int last = program.size() - 1;
+    for (int start = 0 ; start < n ; start += FUSED_BLOCK) {
+      int rows = std::min(FUSED_BLOCK, n - start);
+      for (int i = 0 ; i < nLeaves ; ++i) {
+        query::ColumnType leafType = types[leafSlots[i]];
+        data[leafSlots[i]] = chunkData(columns[i], leafType) +
+          start * strides[i];
+      }
+      for (int k = 0 ; k < last ; ++k) {
+        program[k].kernel(data[program[k].a], data[program[k].b],
+            (void*) data[resultSlots[k]], rows);
+      }
+
+      // bitmap of a comparison starts at a whole byte, FUSED_BLOCK % 8 == 0
+      char* out = (char*) chunkData(result, type) + (type == query::BOOL ?
+          start / 8 : start * global::getTypeSize(type));
+      program[last].kernel(data[program[last].a], data[program[last].b], out,
+          rows);
+    }
+    return result;
+  }
+};
+
+#endif // FUSED_H
@@ -4,14 +4,16 @@
 #include "operation.h"
 
 #include <set>
-#include "keyvalue.h"
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include "hashtable.h"
+#include "utils/logger.h"
 
 using std::set;
 
-GroupByOperation::GroupByOperation(const query::GroupByOperation& oper) {
-  m = NULL;
-  source = Factory::createOperation(oper.source());
-
+GroupByOperation::GroupByOperation(const query::GroupByOperation& oper,
+    Operation* source_): source(source_), spilledBytes(0) {
+  partial = oper.partial();
   groupByColumn = vector<int>(oper.group_by_column_size());
   for (unsigned i = 0 ; i < groupByColumn.size() ; ++i) {
     groupByColumn[i] = oper.group_by_column().Get(i);
@@ -29,6 +31,22 @@ GroupByOperation::GroupByOperation(const query::GroupByOperation& oper) {
     }
   }
 
+  vector<query::ColumnType> sourceTypes = source->getTypes();
+  for (unsigned i = 0 ; i < groupByColumn.size() ; ++i) {
+    keyTypes.push_back(sourceTypes[groupByColumn[i]]);
+  }
+  for (unsigned i = 0 ; i < aggregations.size() ; ++i) {
+    aggregatedTypes.push_back(aggregations[i] == -1 ?
+        query::INVALID_TYPE : sourceTypes[aggregations[i]]);
+  }
+
+  vector<bool> used(sourceTypes.size(), false);
+  vector<int> usedColumns = getUsedColumnsId();
+  for (unsigned i = 0 ; i < usedColumns.size() ; ++i) {
+    used[usedColumns[i]] = true;
+  }
+  compactor = new Compactor(sourceTypes, used);
+
   vector<query::ColumnType> types = getTypes();
   cache = vector<Column*>(types.size());
   for (unsigned int i = 0 ; i < cache.size() ; ++i) {
@@ -36,6 +54,22 @@ GroupByOperation::GroupByOperation(const query::GroupByOperation& oper) {
   }
 }
 
+GroupByOperation::KeyLayout
+GroupByOperation::chooseKeyLayout(const vector<query::ColumnType>& keyTypes) {
+  for (unsigned i = 0 ; i < keyTypes.size() ; ++i) {
+    if (keyTypes[i] != query::INT && keyTypes[i] != query::BOOL) {
+      return GENERIC_KEY;
+    }
+  }
+  if (keyTypes.size() == 1) {
+    return INT32_KEY;
+  } else if (keyTypes.size() == 2) {
+    return PACKED_KEY;
+  } else {
+    return GENERIC_KEY;
+  }
+}
+
 std::ostream& GroupByOperation::debugPrint(std::ostream& output) {
   output << "GroupByOperation { source = " << *source;
   output << "columns = ";
@@ -46,6 +80,10 @@ std::ostream& GroupByOperation::debugPrint(std::ostream& output) {
   for (unsigned i = 0 ; i < aggregations.size() ; ++i) {
     output << aggregations[i] << ",";
   }
+  output << "\nkey layout = " << getLayoutName();
+  if (partial) {
+    output << "\npartial";
+  }
   return output << "}\n";
 }
 
@@ -91,44 +129,341 @@ vector<int> GroupByOperation::getUsedColumnsId() {
   return vector<int>(result.begin(), result.end());
 }
 
-vector<Column*>*
-GroupByOperation::pull() {
-  vector<Column*>* sourceColumns;
+vector<Column*>* GroupByOperation::pullSource() {
+  const SelectionVector* selection;
+  vector<Column*>* sourceColumns = source->pullSelected(&selection);
+  return compactor->compact(sourceColumns, selection);
+}
 
-  if (m == NULL) {
-    m = new MapType();
-    // collect the data
-    do {
-      sourceColumns = source->pull();
-      int n = (*sourceColumns)[0]->size;
+void GroupByOperation::aggregate(vector<Column*>* sourceColumns, int n,
+    any_t* const* targets) {
+  int valueN = aggregations.size();
+  for (int k = 0 ; k < valueN ; ++k) {
+    if (aggregations[k] == -1) {
       for (int i = 0 ; i < n ; ++i) {
-        Key key(sourceColumns, &groupByColumn, i);  
-       typeof(m->end()) it = m->find(key);
-        if (it == m->end()) {
-          // on insert
-          m->insert(MapType::value_type(key, Value(sourceColumns, &aggregations, i)));
+        targets[i][k].int32 += 1;
+      }
+      continue;
+    }
+
+    Column* col = (*sourceColumns)[aggregations[k]];
+    switch (aggregatedTypes[k]) {
+      case query::INT: {
+        int* source = static_cast<ColumnChunk<int>*>(col)->chunk;
+        for (int i = 0 ; i < n ; ++i) {
+          targets[i][k].int32 += source[i];
+        }
+        break;
+      }
+      case query::DOUBLE: {
+        double* source = static_cast<ColumnChunk<double>*>(col)->chunk;
+        for (int i = 0 ; i < n ; ++i) {
+          targets[i][k].double_ += source[i];
+        }
+        break;
+      }
+      case query::BOOL: {
+        char* source = static_cast<ColumnChunk<char>*>(col)->chunk;
+        for (int i = 0 ; i < n ; ++i) {
+          targets[i][k].int32 += (source[i / 8] >> (i & 7)) & 1;
+        }
+        break;
+      }
+      default:
+        assert(false);
+    }
+  }
+}
+
+void GroupByOperation::aggregateGroup(vector<Column*>* sourceColumns, int n,
+    any_t* target) {
+  int valueN = aggregations.size();
+  for (int k = 0 ; k < valueN ; ++k) {
+    if (aggregations[k] == -1) {
+      target[k].int32 += n;
+      continue;
+    }
+
+    Column* col = (*sourceColumns)[aggregations[k]];
+    switch (aggregatedTypes[k]) {
+      case query::INT: {
+        ColumnChunk<int>* source = static_cast<ColumnChunk<int>*>(col);
+        if (source->encoding != NULL) {
+          target[k].int32 += source->encoding->sum(source->chunk, n);
         } else {
-          // on update
-          it->second.update(sourceColumns, &aggregations, i);;
+          for (int i = 0 ; i < n ; ++i) {
+            target[k].int32 += source->chunk[i];
+          }
         }
+        break;
       }
-    } while ((*sourceColumns)[0]->size > 0);
+      case query::DOUBLE: {
+        ColumnChunk<double>* source = static_cast<ColumnChunk<double>*>(col);
+        if (source->encoding != NULL) {
+          target[k].double_ += source->encoding->sum(source->chunk, n);
+        } else {
+          for (int i = 0 ; i < n ; ++i) {
+            target[k].double_ += source->chunk[i];
+          }
+        }
+        break;
+      }
+      case query::BOOL: {
+        char* source = static_cast<ColumnChunk<char>*>(col)->chunk;
+        for (int i = 0 ; i < n ; ++i) {
+          target[k].int32 += (source[i / 8] >> (i & 7)) & 1;
+        }
+        break;
+      }
+      default:
+        assert(false);
+    }
+  }
+}
 
-    it = m->begin();
+const ChunkEncoding<int>*
+GroupByOperation::keyEncoding(vector<Column*>* sourceColumns) {
+  if (groupByColumn.size() != 1 || keyTypes[0] != query::INT) {
+    return NULL;
   }
+  return static_cast<ColumnChunk<int>*>(
+      (*sourceColumns)[groupByColumn[0]])->encoding;
+}
 
-  // serve it
+void GroupByOperation::merge(any_t* values, const any_t* partialValues) {
+  for (unsigned k = 0 ; k < aggregations.size() ; ++k) {
+    if (aggregatedTypes[k] == query::DOUBLE) {
+      values[k].double_ += partialValues[k].double_;
+    } else {
+      values[k].int32 += partialValues[k].int32;
+    }
+  }
+}
+
+static void copyColumn(Column* from, Column* to, query::ColumnType type, int n) {
+  switch (type) {
+    case query::INT:
+      memcpy(static_cast<ColumnChunk<int>*>(to)->chunk,
+          static_cast<ColumnChunk<int>*>(from)->chunk, n * sizeof(int));
+      break;
+    case query::DOUBLE:
+      memcpy(static_cast<ColumnChunk<double>*>(to)->chunk,
+          static_cast<ColumnChunk<double>*>(from)->chunk, n * sizeof(double));
+      break;
+    case query::BOOL:
+      memcpy(static_cast<ColumnChunk<char>*>(to)->chunk,
+          static_cast<ColumnChunk<char>*>(from)->chunk, (n + 7) / 8);
+      break;
+    default:
+      assert(false);
+  }
+}
+
+vector<Column*>*
+GroupByOperation::passThrough(vector<Column*>* sourceColumns, int n) {
+  int keyN = groupByColumn.size();
+  for (int k = 0 ; k < keyN ; ++k) {
+    copyColumn((*sourceColumns)[groupByColumn[k]], cache[k], keyTypes[k], n);
+  }
+
+  for (unsigned k = 0 ; k < aggregations.size() ; ++k) {
+    int* target;
+    switch (aggregatedTypes[k]) {
+      case query::INVALID_TYPE: // count
+        target = static_cast<ColumnChunk<int>*>(cache[keyN + k])->chunk;
+        std::fill(target, target + n, 1);
+        break;
+      case query::BOOL: {
+        char* source =
+          static_cast<ColumnChunk<char>*>((*sourceColumns)[aggregations[k]])->chunk;
+        target = static_cast<ColumnChunk<int>*>(cache[keyN + k])->chunk;
+        for (int i = 0 ; i < n ; ++i) {
+          target[i] = (source[i / 8] >> (i & 7)) & 1;
+        }
+        break;
+      }
+      default:
+        copyColumn((*sourceColumns)[aggregations[k]], cache[keyN + k],
+            aggregatedTypes[k], n);
+    }
+  }
+
+  for (unsigned k = 0 ; k < cache.size() ; ++k) {
+    cache[k]->size = n;
+  }
+  return &cache;
+}
+
+/*
+ * Spilled groups are written as records of the encoded key followed by
+ * aggregate states. Partition is chosen by the highest bits of the hash,
+ * the tables use the lowest ones.
+ */
+template<class Layout>
+void GroupByOperation::spill(const Layout& layout,
+    AggregationHashTable<Layout>* table) {
+  typedef typename Layout::Word Word;
+  size_t keyBytes = layout.width() * sizeof(Word);
+  size_t valueBytes = aggregations.size() * sizeof(any_t);
+
+  if (partitions.empty()) {
+    for (int i = 0 ; i < GROUP_BY_SPILL_PARTITIONS ; ++i) {
+      FILE* partition = tmpfile();
+      CHECK(partition != NULL, "Can't create a group by spill file");
+      partitions.push_back(partition);
+    }
+  }
+
+  for (int id = 0 ; id < table->size() ; ++id) {
+    const Word* key = table->key(id);
+    FILE* partition =
+      partitions[(layout.hash(key) >> 48) % GROUP_BY_SPILL_PARTITIONS];
+    CHECK(fwrite(key, 1, keyBytes, partition) == keyBytes &&
+        fwrite(table->value(id), 1, valueBytes, partition) == valueBytes,
+        "Can't write a group by spill file");
+  }
+  spilledBytes += table->size() * (keyBytes + valueBytes);
+  table->clear();
+}
+
+template<class Layout>
+void GroupByOperation::loadPartition(const Layout& layout, unsigned partition,
+    AggregationHashTable<Layout>* table) {
+  typedef typename Layout::Word Word;
+  size_t keyBytes = layout.width() * sizeof(Word);
+  size_t valueBytes = aggregations.size() * sizeof(any_t);
+  vector<any_t> record((keyBytes + valueBytes) / sizeof(any_t) + 2);
+  Word* key = reinterpret_cast<Word*>(&record[0]);
+  // values start at the first any_t after the key
+  any_t* values = &record[(keyBytes + sizeof(any_t) - 1) / sizeof(any_t)];
+
+  FILE* file = partitions[partition];
+  CHECK(fflush(file) == 0, "Can't write a group by spill file");
+  rewind(file);
+  while (fread(key, 1, keyBytes, file) == keyBytes &&
+      fread(values, 1, valueBytes, file) == valueBytes &&
+      keyBytes + valueBytes > 0) {
+    int id = table->findOrInsert(key, layout.hash(key));
+    merge(table->value(id), values);
+  }
+  CHECK(!ferror(file), "Can't read a group by spill file");
+  fclose(file);
+  partitions[partition] = NULL;
+}
+
+GroupByOperation::~GroupByOperation() {
+  delete compactor;
+  delete source;
+  for (unsigned k = 0 ; k < cache.size() ; ++k) {
+    delete cache[k];
+  }
+  for (unsigned i = 0 ; i < partitions.size() ; ++i) {
+    if (partitions[i] != NULL) {
+      fclose(partitions[i]);
+    }
+  }
+}
+
+// GroupByOperationImpl {{{
+template<class Layout>
+GroupByOperationImpl<Layout>::GroupByOperationImpl(
+    const query::GroupByOperation& oper, Operation* source):
+  GroupByOperation(oper, source), layout(keyTypes), served(0),
+  sourceFinished(false), draining(false), passingThrough(false),
+  consumedRows(0), nextPartition(0) {
+  keyBuffer.resize(MAX_CHUNK_SIZE * layout.width() + 1);
+  table = new AggregationHashTable<Layout>(layout, aggregations.size());
+}
+
+template<class Layout>
+const char* GroupByOperationImpl<Layout>::getLayoutName() {
+  return Layout::name();
+}
+
+template<class Layout>
+int GroupByOperationImpl<Layout>::consumeChunk() {
+  typedef typename Layout::Word Word;
+  int width = layout.width();
+  Word* keys = &keyBuffer[0];
+  int groups[MAX_CHUNK_SIZE];
+  any_t* targets[MAX_CHUNK_SIZE];
+
+  vector<Column*>* sourceColumns = pullSource();
+  int n = (*sourceColumns)[0]->size;
+  if (n == 0) {
+    return 0; // EOF of a union has no other columns
+  }
+  layout.encode(sourceColumns, groupByColumn, n, keys);
+  const ChunkEncoding<int>* encoding = keyEncoding(sourceColumns);
+  if (encoding != NULL && n > 0) {
+    findEncoded(encoding, keys, n, groups);
+    if (encoding->kind == ChunkEncoding<int>::CONSTANT) {
+      aggregateGroup(sourceColumns, n, table->value(groups[0]));
+      return n;
+    }
+  } else {
+    for (int i = 0 ; i < n ; ++i) {
+      const Word* key = &keys[i * width];
+      groups[i] = table->findOrInsert(key, layout.hash(key));
+    }
+  }
+  for (int i = 0 ; i < n ; ++i) {
+    targets[i] = table->value(groups[i]);
+  }
+  aggregate(sourceColumns, n, targets);
+  return n;
+}
+
+template<class Layout>
+void GroupByOperationImpl<Layout>::findEncoded(
+    const ChunkEncoding<int>* encoding, const typename Layout::Word* keys,
+    int n, int* groups) {
+  typedef typename Layout::Word Word;
+  int width = layout.width();
+  if (encoding->kind == ChunkEncoding<int>::DICTIONARY) {
+    int codeGroups[ENCODING_MAX_VALUES];
+    std::fill(codeGroups, codeGroups + encoding->size, -1);
+    for (int i = 0 ; i < n ; ++i) {
+      int code = encoding->codes[i];
+      if (codeGroups[code] == -1) {
+        const Word* key = &keys[i * width];
+        codeGroups[code] = table->findOrInsert(key, layout.hash(key));
+      }
+      groups[i] = codeGroups[code];
+    }
+  } else {
+    // a constant is a single run
+    for (int r = 0 ; r < encoding->size ; ++r) {
+      int start = r == 0 ? 0 : encoding->runEnds[r - 1];
+      int end = encoding->kind == ChunkEncoding<int>::CONSTANT ? n :
+        encoding->runEnds[r];
+      const Word* key = &keys[start * width];
+      std::fill(groups + start, groups + end,
+          table->findOrInsert(key, layout.hash(key)));
+    }
+  }
+}
+
+template<class Layout>
+vector<Column*>*
+GroupByOperationImpl<Layout>::serve() {
+  int keyN = groupByColumn.size();
+  int valueN = aggregations.size();
   int i = 0;
-  while (it != m->end() && i < DEFAULT_CHUNK_SIZE) {
-    it->first.putInto(&cache, i);
-    it->second.putInto(&cache, i, (int)groupByColumn.size());
-    ++it;
+  while (served < table->size() && i < global::chunkSize) {
+    layout.decode(table->key(served), &cache, i);
+    any_t* values = table->value(served);
+    for (int k = 0 ; k < valueN ; ++k) {
+      cache[keyN + k]->take(values[k], i);
+    }
+    ++served;
     ++i;
   }
 
-  if (it == m->end()) {
-    m->clear();
-    it = m->end();
+  if (served == table->size()) {
+    table->clear();
+    served = 0;
+    draining = false;
   }
 
   for (unsigned k = 0 ; k < cache.size() ; ++k) {
@@ -138,13 +473,282 @@ GroupByOperation::pull() {
   return &cache;
 }
 
-GroupByOperation::~GroupByOperation() {
-  delete source;
+template<class Layout>
+vector<Column*>*
+GroupByOperationImpl<Layout>::pull() {
+  if (partial) {
+    return pullPartial();
+  }
+
+  if (!sourceFinished) {
+    // collect the data
+    while (consumeChunk() > 0) {
+      if (table->memoryUsage() > global::groupByMemoryLimit) {
+        spill(layout, table);
+      }
+    }
+    sourceFinished = true;
+    LOG4("GroupBy: %d groups, load factor %.2f, probe length avg %.2f max %d",
+        table->size(), table->loadFactor(), table->averageProbeLength(),
+        table->maxProbeLength());
+    LOG2("GroupBy: %lu bytes in %d arena blocks",
+        (unsigned long) table->memoryUsage(), table->arenaBlocks());
+    if (!partitions.empty()) {
+      // each partition has to contain all the groups of its hashes
+      spill(layout, table);
+      LOG2("GroupBy: spilled %lld bytes to %d partitions", spilledBytes,
+          (int) partitions.size());
+    }
+  }
+
+  // aggregate spilled groups partition by partition
+  while (table->size() == 0 && nextPartition < partitions.size()) {
+    loadPartition(layout, nextPartition, table);
+    nextPartition++;
+  }
+
+  // serve it
+  return serve();
+}
+
+/*
+ * Partial group by aggregates only as long as it pays off. The table is
+ * served (and cleared) whenever it grows above PARTIAL_GROUP_BY_MAX_GROUPS.
+ * If after the first PARTIAL_GROUP_BY_SAMPLE rows there are more than
+ * PARTIAL_GROUP_BY_MAX_RATIO groups per row, the groups collected so far
+ * are served and all the remaining rows are passed through.
+ */
+template<class Layout>
+vector<Column*>*
+GroupByOperationImpl<Layout>::pullPartial() {
+  while (true) {
+    if (table->size() > 0 && (draining || sourceFinished)) {
+      return serve();
+    }
+    if (sourceFinished) {
+      return serve(); // empty
+    }
+
+    if (passingThrough) {
+      vector<Column*>* sourceColumns = pullSource();
+      int n = (*sourceColumns)[0]->size;
+      if (n == 0) {
+        sourceFinished = true;
+        continue;
+      }
+      return passThrough(sourceColumns, n);
+    }
+
+    int n = consumeChunk();
+    if (n == 0) {
+      sourceFinished = true;
+      continue;
+    }
+
+    bool sampled = consumedRows < PARTIAL_GROUP_BY_SAMPLE;
+    consumedRows += n;
+    if (sampled && consumedRows >= PARTIAL_GROUP_BY_SAMPLE &&
+        table->size() > consumedRows * PARTIAL_GROUP_BY_MAX_RATIO) {
+      LOG2("Partial GroupBy: %d groups after %lld rows, passing rows through",
+          table->size(), consumedRows);
+      passingThrough = true;
+      draining = true;
+    } else if (table->size() >= PARTIAL_GROUP_BY_MAX_GROUPS) {
+      draining = true;
+    }
+  }
+}
+
+template<class Layout>
+GroupByOperationImpl<Layout>::~GroupByOperationImpl() {
+  delete table;
+}
+
+template class GroupByOperationImpl<Int32KeyLayout>;
+template class GroupByOperationImpl<PackedKeyLayout>;
+template class GroupByOperationImpl<GenericKeyLayout>;
+// }}}
+
+// ParallelGroupByOperation {{{
+template<class Layout>
+ParallelGroupByOperation<Layout>::ParallelGroupByOperation(
+    const query::GroupByOperation& oper, UnionOperation* source, int threads_):
+  GroupByOperation(oper, source), layout(keyTypes), chunkSource(source),
+  threads(threads_), tables(threads_), chunks(2 * threads_),
+  aggregated(false), partition(0), served(0) {
+  assert(!partial);
+  for (int t = 0 ; t < threads ; ++t) {
+    for (int p = 0 ; p < threads ; ++p) {
+      tables[t].push_back(
+          new AggregationHashTable<Layout>(layout, aggregations.size()));
+    }
+  }
+}
+
+template<class Layout>
+const char* ParallelGroupByOperation<Layout>::getLayoutName() {
+  return Layout::name();
+}
+
+/*
+ * Partition is chosen by the middle bits of the hash, the tables use the
+ * lowest ones.
+ */
+template<class Layout>
+void ParallelGroupByOperation<Layout>::aggregateChunks(int thread) {
+  typedef typename Layout::Word Word;
+  int width = layout.width();
+  vector<Word> keys(MAX_CHUNK_SIZE * width + 1);
+  int partitions[MAX_CHUNK_SIZE];
+  int groups[MAX_CHUNK_SIZE];
+  any_t* targets[MAX_CHUNK_SIZE];
+  vector<AggregationHashTable<Layout>*>& own = tables[thread];
+  // empty tables hold an arena block each, only groups count to the budget
+  size_t emptyBytes = memoryUsage(thread);
+  size_t budget = global::groupByMemoryLimit / threads;
+
+  vector<Column*>* chunk;
+  while (chunks.Consume(chunk) != NULL) {
+    int n = (*chunk)[0]->size;
+    layout.encode(chunk, groupByColumn, n, &keys[0]);
+    for (int i = 0 ; i < n ; ++i) {
+      const Word* key = &keys[i * width];
+      size_t hash = layout.hash(key);
+      partitions[i] = (hash >> 32) % threads;
+      groups[i] = own[partitions[i]]->findOrInsert(key, hash);
+    }
+    for (int i = 0 ; i < n ; ++i) {
+      targets[i] = own[partitions[i]]->value(groups[i]);
+    }
+    aggregate(chunk, n, targets);
+    chunkSource->deleteChunkData(chunk);
+    delete chunk;
+    if (memoryUsage(thread) - emptyBytes > budget) {
+      boost::mutex::scoped_lock lock(spillMutex);
+      for (int p = 0 ; p < threads ; ++p) {
+        spill(layout, own[p]);
+      }
+    }
+  }
+}
+
+template<class Layout>
+void ParallelGroupByOperation<Layout>::mergePartition(int partition) {
+  typedef typename Layout::Word Word;
+  AggregationHashTable<Layout>* target = tables[0][partition];
+  for (int t = 1 ; t < threads ; ++t) {
+    AggregationHashTable<Layout>* table = tables[t][partition];
+    for (int id = 0 ; id < table->size() ; ++id) {
+      const Word* key = table->key(id);
+      int group = target->findOrInsert(key, layout.hash(key));
+      merge(target->value(group), table->value(id));
+    }
+    table->clear();
+  }
+}
+
+template<class Layout>
+size_t ParallelGroupByOperation<Layout>::memoryUsage() {
+  size_t bytes = 0;
+  for (int t = 0 ; t < threads ; ++t) {
+    bytes += memoryUsage(t);
+  }
+  return bytes;
+}
+
+template<class Layout>
+size_t ParallelGroupByOperation<Layout>::memoryUsage(int thread) {
+  size_t bytes = 0;
+  for (int p = 0 ; p < threads ; ++p) {
+    bytes += tables[thread][p]->memoryUsage();
+  }
+  return bytes;
+}
+
+template<class Layout>
+vector<Column*>*
+ParallelGroupByOperation<Layout>::pull() {
+  if (!aggregated) {
+    boost::thread_group aggregators;
+    for (int t = 0 ; t < threads ; ++t) {
+      aggregators.create_thread(boost::bind(
+            &ParallelGroupByOperation<Layout>::aggregateChunks, this, t));
+    }
+    vector<Column*>* chunk;
+    while ((chunk = chunkSource->pullOwned()) != NULL) {
+      chunks.Produce(chunk);
+    }
+    for (int t = 0 ; t < threads ; ++t) {
+      chunks.Produce(NULL);
+    }
+    aggregators.join_all();
+    LOG1("Parallel GroupBy: %lu bytes in arenas",
+        (unsigned long) memoryUsage());
+    LOG1("Parallel GroupBy: aggregated by %d threads", threads);
+
+    if (partitions.empty()) {
+      boost::thread_group mergers;
+      for (int p = 0 ; p < threads ; ++p) {
+        mergers.create_thread(boost::bind(
+              &ParallelGroupByOperation<Layout>::mergePartition, this, p));
+      }
+      mergers.join_all();
+    } else {
+      // each partition has to contain all the groups of its hashes
+      for (int t = 0 ; t < threads ; ++t) {
+        for (int p = 0 ; p < threads ; ++p) {
+          spill(layout, tables[t][p]);
+        }
+      }
+      LOG2("Parallel GroupBy: spilled %lld bytes to %d partitions",
+          spilledBytes, (int) partitions.size());
+      loadPartition(layout, 0, tables[0][0]);
+    }
+    aggregated = true;
+  }
+
+  // serve merged partitions, or spilled ones loaded into tables[0][0]
+  bool spilled = !partitions.empty();
+  int partitionN = spilled ? partitions.size() : threads;
+  int keyN = groupByColumn.size();
+  int valueN = aggregations.size();
+  int i = 0;
+  while (partition < partitionN && i < global::chunkSize) {
+    AggregationHashTable<Layout>* table = tables[0][spilled ? 0 : partition];
+    if (served == table->size()) {
+      table->clear();
+      partition++;
+      served = 0;
+      if (spilled && partition < partitionN) {
+        loadPartition(layout, partition, table);
+      }
+      continue;
+    }
+    layout.decode(table->key(served), &cache, i);
+    any_t* values = table->value(served);
+    for (int k = 0 ; k < valueN ; ++k) {
+      cache[keyN + k]->take(values[k], i);
+    }
+    ++served;
+    ++i;
+  }
+
   for (unsigned k = 0 ; k < cache.size() ; ++k) {
-    delete cache[k];
+    cache[k]->size = i;
   }
+  return &cache;
+}
 
-  if (m != NULL) {
-    delete m;
+template<class Layout>
+ParallelGroupByOperation<Layout>::~ParallelGroupByOperation() {
+  for (int t = 0 ; t < threads ; ++t) {
+    for (int p = 0 ; p < threads ; ++p) {
+      delete tables[t][p];
+    }
   }
 }
+
+template class ParallelGroupByOperation<Int32KeyLayout>;
+template class ParallelGroupByOperation<PackedKeyLayout>;
+template class ParallelGroupByOperation<GenericKeyLayout>;
+// }}}
@@ -0,0 +1,409 @@
+// Fast And Furious column database
+// Author: Jacek Migdal <jacek@migdal.pl>
+
+#ifndef HASHTABLE_H
+#define HASHTABLE_H
+
+#include <cassert>
+#include <cstring>
+#include <stdint.h>
+#include <vector>
+
+#include "arena.h"
+#include "column.h"
+
+using std::vector;
+
+inline size_t mixHash(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// Key layouts {{{
+// A layout describes how group by keys are normalized into fixed-width
+// words. It's chosen by the factory from key column types, see
+// GroupByOperation::chooseKeyLayout. Keys are encoded a column at a time
+// for the whole chunk and decoded row by row when groups are served.
+
+/** Single INT or BOOL key */
+class Int32KeyLayout {
+ public:
+  typedef int32_t Word;
+
+  Int32KeyLayout(const vector<query::ColumnType>& types) {
+    assert(types.size() == 1);
+    type = types[0];
+  }
+
+  static const char* name() { return "INT32"; }
+
+  int width() const { return 1; }
+
+  size_t hash(const Word* key) const {
+    return mixHash((uint32_t) *key);
+  }
+
+  bool equal(const Word* a, const Word* b) const {
+    return *a == *b;
+  }
+
+  void encode(vector<Column*>* sources, const vector<int>& columns, int n,
+      Word* target) const {
+    Column* col = (*sources)[columns[0]];
+    if (type == query::BOOL) {
+      char* source = static_cast<ColumnChunk<char>*>(col)->chunk;
+      for (int i = 0 ; i < n ; ++i) {
+        target[i] = (source[i / 8] >> (i & 7)) & 1;
+      }
+    } else {
+      int* source = static_cast<ColumnChunk<int>*>(col)->chunk;
+      std::copy(source, source + n, target);
+    }
+  }
+
+  void decode(const Word* key, vector<Column*>* result, int idx) const {
+    any_t value;
+    if (type == query::BOOL) {
+      value.boolean = *key;
+    } else {
+      value.int32 = *key;
+    }
+    (*result)[0]->take(value, idx);
+  }
+
+ private:
+  query::ColumnType type;
+};
+
+/** Two INT or BOOL keys packed into one word */
+class PackedKeyLayout {
+ public:
+  typedef uint64_t Word;
+
+  PackedKeyLayout(const vector<query::ColumnType>& types_): types(types_) {
+    assert(types.size() == 2);
+  }
+
+  static const char* name() { return "PACKED"; }
+
+  int width() const { return 1; }
+
+  size_t hash(const Word* key) const {
+    return mixHash(*key);
+  }
+
+  bool equal(const Word* a, const Word* b) const {
+    return *a == *b;
+  }
+
+  void encode(vector<Column*>* sources, const vector<int>& columns, int n,
+      Word* target) const {
+    for (int k = 0 ; k < 2 ; ++k) {
+      int shift = k == 0 ? 32 : 0;
+      Column* col = (*sources)[columns[k]];
+      if (types[k] == query::BOOL) {
+        char* source = static_cast<ColumnChunk<char>*>(col)->chunk;
+        for (int i = 0 ; i < n ; ++i) {
+          Word bit = (source[i / 8] >> (i & 7)) & 1;
+          target[i] = k == 0 ? bit << shift : target[i] | bit;
+        }
+      } else {
+        int* source = static_cast<ColumnChunk<int>*>(col)->chunk;
+        for (int i = 0 ; i < n ; ++i) {
+          Word value = (uint32_t) source[i];
+          target[i] = k == 0 ? value << shift : target[i] | value;
+        }
+      }
+    }
+  }
+
+  void decode(const Word* key, vector<Column*>* result, int idx) const {
+    for (int k = 0 ; k < 2 ; ++k) {
+      int32_t word = k == 0 ? (int32_t) (*key >> 32) : (int32_t) *key;
+      any_t value;
+      if (types[k] == query::BOOL) {
+        value.boolean = word;
+      } else {
+        value.int32 = word;
+      }
+      (*result)[k]->take(value, idx);
+    }
+  }
+
+ private:
+  vector<query::ColumnType> types;
+};
+
+/** Any number of keys of any type, byte-packed at their natural widths */
+class GenericKeyLayout {
+ public:
+  typedef char Word;
+
+  GenericKeyLayout(const vector<query::ColumnType>& types_):
+    types(types_), offsets(types_.size()) {
+    bytes = 0;
+    for (unsigned k = 0 ; k < types.size() ; ++k) {
+      offsets[k] = bytes;
+      bytes += global::getTypeSize(types[k]);
+    }
+  }
+
+  static const char* name() { return "GENERIC"; }
+
+  int width() const { return bytes; }
+
+  size_t hash(const Word* key) const {
+    uint64_t h = 0;
+    int i = 0;
+    for ( ; i + 8 <= bytes ; i += 8) {
+      uint64_t word;
+      memcpy(&word, key + i, 8);
+      h = mixHash(h ^ word);
+    }
+    if (i < bytes) {
+      uint64_t word = 0;
+      memcpy(&word, key + i, bytes - i);
+      h = mixHash(h ^ word);
+    }
+    return h;
+  }
+
+  bool equal(const Word* a, const Word* b) const {
+    return 0 == memcmp(a, b, bytes);
+  }
+
+  void encode(vector<Column*>* sources, const vector<int>& columns, int n,
+      Word* target) const {
+    for (unsigned k = 0 ; k < types.size() ; ++k) {
+      Column* col = (*sources)[columns[k]];
+      Word* dst = target + offsets[k];
+      switch (types[k]) {
+        case query::INT:
+          encodeColumn(static_cast<ColumnChunk<int>*>(col)->chunk, n, dst);
+          break;
+        case query::DOUBLE:
+          encodeColumn(static_cast<ColumnChunk<double>*>(col)->chunk, n, dst);
+          break;
+        case query::BOOL: {
+          char* source = static_cast<ColumnChunk<char>*>(col)->chunk;
+          for (int i = 0 ; i < n ; ++i) {
+            dst[i * bytes] = (source[i / 8] >> (i & 7)) & 1;
+          }
+          break;
+        }
+        default:
+          assert(false);
+      }
+    }
+  }
+
+  void decode(const Word* key, vector<Column*>* result, int idx) const {
+    for (unsigned k = 0 ; k < types.size() ; ++k) {
+      any_t value;
+      switch (types[k]) {
+        case query::INT:
+          memcpy(&value.int32, key + offsets[k], sizeof(int));
+          break;
+        case query::DOUBLE:
+          memcpy(&value.double_, key + offsets[k], sizeof(double));
+          break;
+        case query::BOOL:
+          value.boolean = key[offsets[k]];
+          break;
+        default:
+          assert(false);
+      }
+      (*result)[k]->take(value, idx);
+    }
+  }
+
+ private:
+  template<class T>
+  void encodeColumn(T* source, int n, Word* dst) const {
+    for (int i = 0 ; i < n ; ++i) {
+      memcpy(dst + i * bytes, &source[i], sizeof(T));
+    }
+  }
+
+  vector<query::ColumnType> types;
+  vector<int> offsets;
+  int bytes;
+};
+// }}}
+
+/**
+ * Hash table used by group by.
+ *
+ * Groups are stored densely in insertion order, in pages of PAGE_GROUPS
+ * groups: `layout.width()` words of the key and `valueWidth` aggregate
+ * states per group. Pages never move, so growing copies nothing. The
+ * open-addressing index (linear probing, power of two capacity) keeps only
+ * the full hash and the group id, so growing it never touches keys or
+ * aggregates - slots are reinserted using the stored hash.
+ * Pages come from an arena of the table, clear() and the destructor free
+ * them at once. The index is a buffer of its own, freed as soon as it grows.
+ */
+template<class Layout>
+class AggregationHashTable {
+  typedef typename Layout::Word Word;
+
+  struct Slot {
+    size_t hash;
+    int id; // -1 when empty
+  };
+
+  static const int PAGE_BITS = 10;
+  static const int PAGE_GROUPS = 1 << PAGE_BITS;
+
+  const Layout& layout;
+  int keyWidth;
+  int valueWidth;
+  int count;
+  size_t mask;
+  Arena arena;
+  Slot* slots;
+  size_t capacity; // of slots
+  vector<Word*> keyPages;
+  vector<any_t*> valuePages;
+
+  // probe statistics
+  long long lookups;
+  long long probes;
+  int maxProbe;
+
+  void resetSlots(size_t capacity_) {
+    capacity = capacity_;
+    slots = static_cast<Slot*>(
+        util::BufferPool::Instance().Allocate(capacity * sizeof(Slot)));
+    mask = capacity - 1;
+    for (size_t i = 0 ; i < capacity ; ++i) {
+      slots[i].id = -1;
+    }
+  }
+
+  void grow() {
+    Slot* old = slots;
+    size_t oldCapacity = capacity;
+    resetSlots(oldCapacity * 2);
+    for (size_t i = 0 ; i < oldCapacity ; ++i) {
+      if (old[i].id != -1) {
+        size_t pos = old[i].hash & mask;
+        while (slots[pos].id != -1) {
+          pos = (pos + 1) & mask;
+        }
+        slots[pos] = old[i];
+      }
+    }
+    util::BufferPool::Instance().Release(old);
+  }
+
+  void addPage() {
+    keyPages.push_back(static_cast<Word*>(
+          arena.allocate(PAGE_GROUPS * keyWidth * sizeof(Word))));
+    valuePages.push_back(static_cast<any_t*>(
+          arena.allocate(PAGE_GROUPS * valueWidth * sizeof(any_t))));
+  }
+
+ public:
+  static const int INITIAL_CAPACITY = 1024; // in slots, power of two
+
+  AggregationHashTable(const Layout& layout_, int valueWidth_):
+    layout(layout_), keyWidth(layout_.width()), valueWidth(valueWidth_),
+    count(0), lookups(0), probes(0), maxProbe(0) {
+    resetSlots(INITIAL_CAPACITY);
+  }
+
+  /**
+   * Returns the id of the group for a given key, a new group with zeroed
+   * aggregates is created if there's none.
+   */
+  int findOrInsert(const Word* key, size_t hash) {
+    // keep load factor below 1/2
+    if (2 * (count + 1) > (int) capacity) {
+      grow();
+    }
+
+    size_t pos = hash & mask;
+    int probe = 1;
+    while (slots[pos].id != -1) {
+      if (slots[pos].hash == hash && layout.equal(this->key(slots[pos].id), key)) {
+        break;
+      }
+      pos = (pos + 1) & mask;
+      ++probe;
+    }
+
+    ++lookups;
+    probes += probe;
+    if (probe > maxProbe) {
+      maxProbe = probe;
+    }
+
+    if (slots[pos].id == -1) {
+      if ((count & (PAGE_GROUPS - 1)) == 0) {
+        addPage();
+      }
+      slots[pos].hash = hash;
+      slots[pos].id = count++;
+      int id = count - 1;
+      std::copy(key, key + keyWidth,
+          keyPages[id >> PAGE_BITS] + (id & (PAGE_GROUPS - 1)) * keyWidth);
+      memset(value(id), 0, valueWidth * sizeof(any_t));
+    }
+    return slots[pos].id;
+  }
+
+  const Word* key(int id) const {
+    return keyPages[id >> PAGE_BITS] + (id & (PAGE_GROUPS - 1)) * keyWidth;
+  }
+
+  any_t* value(int id) {
+    return valuePages[id >> PAGE_BITS] + (id & (PAGE_GROUPS - 1)) * valueWidth;
+  }
+
+  /** Number of groups */
+  int size() const {
+    return count;
+  }
+
+  /** Drops all the groups and frees the memory */
+  void clear() {
+    arena.reset();
+    util::BufferPool::Instance().Release(slots);
+    vector<Word*>().swap(keyPages);
+    vector<any_t*>().swap(valuePages);
+    resetSlots(INITIAL_CAPACITY);
+    count = 0;
+  }
+
+  /** Bytes held by the arena and the index of the table */
+  size_t memoryUsage() const {
+    return arena.memoryUsage() + util::BufferPool::Capacity(slots);
+  }
+
+  int arenaBlocks() const {
+    return arena.blockCount();
+  }
+
+  double loadFactor() const {
+    return (double) count / capacity;
+  }
+
+  double averageProbeLength() const {
+    return lookups == 0 ? 0.0 : (double) probes / lookups;
+  }
+
+  int maxProbeLength() const {
+    return maxProbe;
+  }
+
+  ~AggregationHashTable() {
+    util::BufferPool::Instance().Release(slots);
+  }
+};
+
+#endif // HASHTABLE_H
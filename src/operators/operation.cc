@@ -3,8 +3,13 @@
 
 #include "operation.h"
 
+#include <sstream>
+
+#include "compaction.h"
 #include "distributed/node.h"
+#include "distributed/encoding.h"
 #include "node_environment/sink_server_proxy.h"
+#include "utils/logger.h"
 
 int Operation::consume() {
   vector<Column*>* ptr = pull();
@@ -20,6 +25,107 @@ int Operation::consume() {
   return (*ptr)[0]->size;
 }
 
+// Compactor {{{
+Compactor::Compactor(const vector<query::ColumnType>& types,
+    const vector<bool>& used_): used(used_), dense(types.size()) {
+  assert(used.size() == types.size());
+  for (unsigned i = 0 ; i < dense.size() ; ++i) {
+    dense[i] = Factory::createColumnFromType(types[i]);
+  }
+}
+
+vector<Column*>* Compactor::compact(vector<Column*>* columns,
+    const SelectionVector* selection) {
+  if (selection == NULL) {
+    return columns;
+  }
+  for (unsigned i = 0 ; i < dense.size() ; ++i) {
+    if (used[i]) {
+      (*columns)[i]->select(*selection, dense[i]);
+    } else {
+      dense[i]->size = selection->size;
+    }
+  }
+  return &dense;
+}
+
+Compactor::~Compactor() {
+  for (unsigned i = 0 ; i < dense.size() ; ++i) {
+    delete dense[i];
+  }
+}
+// }}}
+
+// Coalescer {{{
+Coalescer::Coalescer(const vector<query::ColumnType>& types):
+  dense(types.size()), rows(0), flushed(false) {
+  for (unsigned i = 0 ; i < dense.size() ; ++i) {
+    dense[i] = Factory::createColumnFromType(types[i]);
+  }
+  std::fill(inputFill, inputFill + BUCKETS, 0);
+  std::fill(outputFill, outputFill + BUCKETS, 0);
+}
+
+static char* chunkData(Column* column) {
+  switch (column->getType()) {
+    case query::INT:
+      return (char*) static_cast<ColumnChunk<int>*>(column)->chunk;
+    case query::DOUBLE:
+      return (char*) static_cast<ColumnChunk<double>*>(column)->chunk;
+    case query::BOOL:
+      return static_cast<ColumnChunk<char>*>(column)->chunk;
+    default:
+      assert(false);
+      return NULL;
+  }
+}
+
+void Coalescer::append(vector<Column*>* columns, const int* selected, int n) {
+  if (flushed) {
+    rows = 0;
+    flushed = false;
+  }
+  assert(rows + n <= global::chunkSize);
+  for (unsigned i = 0 ; i < dense.size() ; ++i) {
+    (*columns)[i]->transfuseRows(chunkData(dense[i]), rows, selected, n);
+  }
+  rows += n;
+}
+
+vector<Column*>* Coalescer::flush() {
+  for (unsigned i = 0 ; i < dense.size() ; ++i) {
+    dense[i]->size = rows;
+  }
+  observeOutput(rows);
+  flushed = true;
+  return &dense;
+}
+
+void Coalescer::count(long long* histogram, int rows) {
+  int bucket = (long long) rows * BUCKETS / global::chunkSize;
+  histogram[std::min(bucket, BUCKETS - 1)]++;
+}
+
+std::string Coalescer::print(const long long* histogram) {
+  std::ostringstream output;
+  for (int i = 0 ; i < BUCKETS ; ++i) {
+    output << (i == 0 ? "" : " ") << histogram[i];
+  }
+  return output.str();
+}
+
+std::string Coalescer::histogram() {
+  return "chunks by tenths of fill in [" + print(inputFill) + "] out [" +
+    print(outputFill) + "]";
+}
+
+Coalescer::~Coalescer() {
+  for (unsigned i = 0 ; i < dense.size() ; ++i) {
+    delete dense[i];
+  }
+}
+// }}}
+
 // ScanOperation {{{ 
 ScanOperation::ScanOperation(const query::ScanOperation& oper) {
   int n = oper.column_size();
@@ -73,21 +179,51 @@ ScanFileOperation::ScanFileOperation(const query::ScanFileOperation& oper) {
   source = NULL;
   sourceFileId = oper.source();
   providers = vector<ColumnProvider*>(n);
+  filesLeft = true;
+  filesScanned = 0;
 
   for (int i = 0 ; i < n ; ++i) {
     providers[i] = Factory::createFileColumnProvider(&source,
         oper.column().Get(i), (query::ColumnType) oper.type().Get(i));
+    eof.push_back(Factory::createColumnFromType(
+          (query::ColumnType) oper.type().Get(i)));
   }
 }
 
-vector<Column*>*
-ScanFileOperation::pull() {
-  if (source == NULL) {
-    source = global::worker->communication.openSourceInterface(sourceFileId);
+bool ScanFileOperation::openSource() {
+  int file = sourceFileId;
+  if (file == ASK_FOR_FILES) {
+    file = filesLeft ? global::worker->communication.requestFile() : -1;
+    if (file < 0) {
+      filesLeft = false;
+      LOG1("ScanFile: %d files scanned", filesScanned);
+      return false;
+    }
   }
+  source = global::worker->communication.openSourceInterface(file);
+  ++filesScanned;
+  return true;
+}
 
-  for (unsigned i = 0 ; i < providers.size() ; ++i) {
-    cache[i] = providers[i]->pull();
+/*
+ * Files asked from the scheduler are read one after another, a new one is
+ * asked for when the previous one ends.
+ */
+vector<Column*>*
+ScanFileOperation::pull() {
+  while (true) {
+    if (source == NULL && !openSource()) {
+      cache = eof;
+      return &cache;
+    }
+    for (unsigned i = 0 ; i < providers.size() ; ++i) {
+      cache[i] = providers[i]->pull();
+    }
+    if (cache[0]->size > 0 || sourceFileId != ASK_FOR_FILES) {
+      break;
+    }
+    delete source;
+    source = NULL;
   }
   return &cache;
 }
@@ -113,11 +249,23 @@ ScanFileOperation::debugPrint(std::ostream& output) {
 ScanFileOperation::~ScanFileOperation() {
   for (unsigned i = 0 ; i < providers.size() ; ++i) {
     delete providers[i];
+    delete eof[i];
   }
+  delete source;
 }
 // }}}
 
 // ComputeOperation {{{
+static void markUsedColumns(const query::Expression& expression,
+    vector<bool>* used) {
+  if (expression.operator_() == query::Expression::COLUMN) {
+    (*used)[expression.column_id()] = true;
+  }
+  for (int i = 0 ; i < expression.children_size() ; ++i) {
+    markUsedColumns(expression.children(i), used);
+  }
+}
+
 ComputeOperation::ComputeOperation(const query::ComputeOperation& oper) {
   source = Factory::createOperation(oper.source());
 
@@ -126,14 +274,25 @@ ComputeOperation::ComputeOperation(const query::ComputeOperation& oper) {
   cache = vector<Column*>(n);
 
   vector<query::ColumnType> types = source->getTypes();
+  vector<query::Expression> simplified(n);
+  for (int i = 0 ; i < n ; ++i) {
+    simplified[i] = Factory::simplifyExpression(oper.expressions(i), types);
+    context.addUses(simplified[i]);
+  }
+
+  vector<bool> used(types.size(), false);
   for (int i = 0 ; i < n ; ++i) {
-    expressions[i] = Factory::createExpression(
-        oper.expressions().Get(i), types);
+    expressions[i] = Factory::createExpression(simplified[i], types, &context);
+    markUsedColumns(simplified[i], &used);
   }
+  compactor = new Compactor(types, used);
 }
 
 vector<Column*>* ComputeOperation::pull() {
-  vector<Column*>* sourceColumns = source->pull();
+  const SelectionVector* selection;
+  vector<Column*>* sourceColumns = source->pullSelected(&selection);
+  sourceColumns = compactor->compact(sourceColumns, selection);
+  context.nextChunk();
   for (unsigned i = 0 ; i < cache.size() ; ++i) {
     cache[i] = expressions[i]->pull(sourceColumns);
   }
@@ -161,6 +320,7 @@ ComputeOperation::~ComputeOperation() {
   for (unsigned i = 0 ; i < expressions.size() ; ++i) {
     delete expressions[i];
   }
+  delete compactor;
   delete source;
 }
 // }}}
@@ -170,31 +330,116 @@ FilterOperation::FilterOperation(const query::FilterOperation& oper) {
   source = Factory::createOperation(oper.source());
   vector<query::ColumnType> types = source->getTypes();
   result = vector<Column*>(types.size());
-  condition = Factory::createExpression(oper.expression(), types);
+  query::Expression simplified =
+    Factory::simplifyExpression(oper.expression(), types);
+  context.addUses(simplified);
+  condition = Factory::createExpression(simplified, types, &context);
 
   for (unsigned i = 0 ; i < result.size() ; ++i) {
     result[i] = Factory::createColumnFromType(types[i]);
   }
+  coalescer = new Coalescer(types);
+  held = NULL;
 }
 
 vector<Column*>* FilterOperation::pull() {
-  vector<Column*>* sourceColumns = source->pull();
-  Column* cond = condition->pull(sourceColumns);
-
-  if (sourceColumns->empty()) {
+  const SelectionVector* selected;
+  vector<Column*>* sourceColumns = pullSelected(&selected);
+  if (selected == NULL) {
     return sourceColumns;
   }
 
   for (unsigned k = 0 ; k < result.size() ; ++k) {
-    (*sourceColumns)[k]->filter(cond, result[k]);
+    (*sourceColumns)[k]->select(*selected, result[k]);
   }
+  return &result;
+}
 
-  if (result[0]->size == 0 && (*sourceColumns)[0]->size > 0) {
-    // No results, reapeat
-    return pull();
-  }
+/*
+ * Chunks with few selected rows are appended to the coalescer until it's
+ * filled to COALESCE_FILL_RATIO. The source isn't pulled again until a held
+ * chunk is served, so it stays valid.
+ */
+vector<Column*>*
+FilterOperation::pullSelected(const SelectionVector** selected) {
+  *selected = NULL;
+  if (held != NULL) {
+    vector<Column*>* columns = held;
+    held = NULL;
+    if (!heldSparse) {
+      *selected = heldSelection;
+      if (columns->empty() || (*columns)[0]->size == 0) {
+        LOG1("Filter: %s", coalescer->histogram().c_str());
+      } else {
+        coalescer->observeOutput(heldSelection == NULL ?
+            (*columns)[0]->size : heldSelection->size);
+      }
+      return columns;
+    }
+    coalescer->append(columns, selection.rows, selection.size);
+  }
+
+  while (true) {
+    const SelectionVector* sourceSelection;
+    vector<Column*>* sourceColumns = source->pullSelected(&sourceSelection);
+    if (sourceColumns->empty() || (*sourceColumns)[0]->size == 0) {
+      if (coalescer->size() > 0) {
+        held = sourceColumns;
+        heldSelection = NULL;
+        heldSparse = false;
+        return coalescer->flush();
+      }
+      LOG1("Filter: %s", coalescer->histogram().c_str());
+      return sourceColumns;
+    }
 
-  return &result;
+    context.nextChunk();
+    Column* cond = condition->pull(sourceColumns);
+    unsigned char* cT =
+      (unsigned char*) static_cast<ColumnChunk<char>*>(cond)->chunk;
+    int n = cond->size;
+    int* rows = selection.rows;
+    int count = 0;
+    if (sourceSelection == NULL) {
+      count = selectRows(cT, n, rows);
+    } else {
+      n = sourceSelection->size;
+      for (int j = 0 ; j < n ; ++j) {
+        int i = sourceSelection->rows[j];
+        rows[count] = i;
+        count += (cT[i / 8] >> (i & 7)) & 1;
+      }
+    }
+
+    if (count == 0) {
+      continue; // no results, repeat
+    }
+    selection.size = count;
+    coalescer->observeInput(count);
+    const SelectionVector* chunkSelection =
+      count == n ? sourceSelection : &selection;
+
+    if (!coalescer->sparse(count)) {
+      if (coalescer->size() > 0) {
+        held = sourceColumns;
+        heldSelection = chunkSelection;
+        heldSparse = false;
+        return coalescer->flush();
+      }
+      coalescer->observeOutput(count);
+      *selected = chunkSelection;
+      return sourceColumns;
+    }
+    if (!coalescer->fits(count)) {
+      held = sourceColumns;
+      heldSparse = true;
+      return coalescer->flush();
+    }
+    coalescer->append(sourceColumns, rows, count);
+    if (!coalescer->sparse(coalescer->size())) {
+      return coalescer->flush();
+    }
+  }
 }
 
 std::ostream& FilterOperation::debugPrint(std::ostream& output) {
@@ -207,6 +452,7 @@ vector<query::ColumnType> FilterOperation::getTypes() {
 }
 
 FilterOperation::~FilterOperation() {
+  delete coalescer;
   for (unsigned i = 0 ; i < result.size() ; ++i) {
     delete result[i];
 
@@ -229,13 +475,11 @@ ShuffleOperation::ShuffleOperation(const query::ShuffleOperation& oper) {
   for (int i = 0; i < oper.hash_column_size(); i++) {
     hashColumns.push_back(oper.hash_column(i));
   }
-  buckets = vector< vector<Column*> >(receiversCount);
+  buckets = vector< vector<int> >(receiversCount);
   for (unsigned int i = 0; i < buckets.size(); i++) {
-    buckets[i] = std::vector<Column*>(columnTypes.size());
-    for (unsigned j = 0; j < columnTypes.size(); j++) {
-      buckets[i][j] = Factory::createColumnFromType(columnTypes[j]);
-    }
+    buckets[i].reserve(global::chunkSize);
   }
+  cache.resize(columns.size());
   columnsHash = Factory::createColumnFromType(query::HASH);
 }
 
@@ -255,43 +499,36 @@ void hashSourceColumns(const vector<Column*>* sourceColumns, vector<int> which,
   }
 }
 
-vector< vector<Column*> >* ShuffleOperation::bucketsPull() {
-  vector<Column*>* sourceColumns = source->pull();
-  // zero column sizes in all buckets
+vector<Column*>* ShuffleOperation::bucketsPull(
+    const vector< vector<int> >** rows) {
+  const SelectionVector* selection;
+  vector<Column*>* sourceColumns = source->pullSelected(&selection);
+  *rows = &buckets;
   for (unsigned int i = 0; i < receiversCount; i++) {
-    for (unsigned int j = 0; j < buckets[i].size(); j++) {
-      buckets[i][j]->size = 0;
-    }
+    buckets[i].clear();
   }
+  if (sourceColumns->empty()) {
+    return sourceColumns;
+  }
+  for (unsigned i = 0; i < columns.size(); i++) {
+    cache[i] = (*sourceColumns)[columns[i]];
+  }
+  int n = selection == NULL ? (*sourceColumns)[0]->size : selection->size;
   if (hashColumns.size() > 0) {
     assert(receiversCount >= 1);
     hashSourceColumns(sourceColumns, hashColumns, columnsHash);
     size_t* hashes = static_cast<ColumnChunk<size_t>*>(columnsHash)->chunk;
-    for (int i = 0; i < columnsHash->size; i++) {
-      int bucketNumber = hashes[i] % receiversCount;
-      vector<Column*>* bucket = &buckets[bucketNumber];
-      any_t data;
-      for (unsigned j = 0; j < bucket->size() ; j++) {
-        (*sourceColumns)[j]->fill(&data, i);
-        Column* col = (*bucket)[j];
-        col->take(data, col->size);
-        col->size++;
-      }
+    for (int r = 0; r < n; r++) {
+      int i = selection == NULL ? r : selection->rows[r];
+      buckets[hashes[i] % receiversCount].push_back(i);
     }
   } else {
     assert(receiversCount == 1);
-    for (unsigned i = 0; i < columns.size() ; i++) {
-      Column* sourceCol = (*sourceColumns)[columns[i]];
-      Column* destCol = buckets[0][i];
-      any_t data;
-      for (int j = 0; j < sourceCol->size; j++) {
-        sourceCol->fill(&data, j);
-        destCol->take(data, destCol->size);
-        destCol->size++;
-      }
+    for (int r = 0; r < n; r++) {
+      buckets[0].push_back(selection == NULL ? r : selection->rows[r]);
     }
   }
-  return &buckets;
+  return &cache;
 }
 
 std::ostream& ShuffleOperation::debugPrint(std::ostream& output) {
@@ -362,16 +599,17 @@ vector<Column*>* UnionOperation::pull() {
   query::DataResponse* dataResponse;
   while (cache.size() == 0 && finished != sourcesNode.size()) {
     global::worker->communication.getResponse();
-    dataResponse = global::worker->communication.responses.front();
+    ReceivedResponse received = global::worker->communication.responses.front();
     global::worker->communication.responses.pop();
+    dataResponse = received.first;
 
     // ask for more
     if (dataResponse->number() > 0) {
       query::DataRequest request;
       global::worker->communication.inputBuffer \
         .sendRequest(dataResponse->stripe(), 1, dataResponse->node()); // TODO: set it more reasonable
-      assert(dataResponse->data().data_size() == dataResponse->data().type_size());
-      processReceivedData(dataResponse);
+      assert(dataResponse->data().data_size_size() == dataResponse->data().type_size());
+      processReceivedData(dataResponse, received.second);
     } else {
       global::worker->communication.debugPrint("Got EOF from node %d stripe %d\n",
           dataResponse->node(), dataResponse->stripe());
@@ -397,6 +635,15 @@ vector<Column*>* UnionOperation::pull() {
   return tmp;
 }
 
+vector<Column*>* UnionOperation::pullOwned() {
+  vector<Column*>* chunk = pull();
+  if (chunk == &eof) {
+    return NULL;
+  }
+  tmp = NULL;
+  return chunk;
+}
+
 void UnionOperation::deleteChunkData(vector<Column *>* chunk) {
   //printf("UnionOperation::deleteChunkData...\n");
   for (uint32_t i = 0; i < chunk->size(); i++)
@@ -412,23 +659,57 @@ UnionOperation::~UnionOperation() {
   }
 }
 
-void UnionOperation::processReceivedData(query::DataResponse *response) {
+/** Chunk of rows [from, from + rows) of a column laid out as by transfuse */
+template<class T>
+static Column* viewChunk(const char* data, int from, int rows,
+    const boost::shared_ptr<ReceivedPacket>& packet) {
+  return new ColumnChunkView<T>((T*) data + from, rows, packet);
+}
+
+/** Bitmaps can be shared only from a whole byte */
+template<>
+Column* viewChunk<char>(const char* data, int from, int rows,
+    const boost::shared_ptr<ReceivedPacket>& packet) {
+  if (from % 8 != 0) {
+    return deserializeChunk<char>(from, data, rows);
+  }
+  return new ColumnChunkView<char>((char*) data + from / 8, rows, packet);
+}
+
+void UnionOperation::processReceivedData(query::DataResponse *response,
+    const boost::shared_ptr<ReceivedPacket>& packet) {
   //printf("UnionOperation::processReceivedData...\n");
   int from_row = 0;
-  assert(response->data().data(0).size() % global::getTypeSize(response->data().type(0)) == 0);
-  int size = response->data().data(0).size() /
-             global::getTypeSize(response->data().type(0));
+  const query::DataPacket& dataPacket = response->data();
+  int size = dataPacket.rows();
   int chunk_size;
   //printf("size = %d\n", size);
 
-  query::DataPacket *packet = response->mutable_data();
+  // plain columns are used in place, encoded ones are decoded next to them
+  vector<const char*> data(types.size(), NULL);
+  const char* payload = packet->payload;
+  for (uint32_t i = 0; i < types.size(); i++) {
+    if (columnIsUsed[i]) {
+      if (dataPacket.encoding_size() == 0 ||
+          dataPacket.encoding(i) == query::DataPacket::PLAIN) {
+        data[i] = payload;
+      } else {
+        char* decoded =
+          packet->allocate(size * global::getTypeSize(types[i]));
+        unpackColumn(types[i], dataPacket.encoding(i), payload, size, decoded);
+        data[i] = decoded;
+      }
+    }
+    payload += alignPacket(dataPacket.data_size(i));
+  }
+
   vector<Column*> *chunk;
   Column *col;
 
   while (from_row < size) {
     chunk = new vector<Column*>;
 
-    chunk_size = std::min(DEFAULT_CHUNK_SIZE, size - from_row);
+    chunk_size = std::min(global::chunkSize, size - from_row);
 
     for (uint32_t i = 0; i < types.size(); i++) {
       if (!columnIsUsed[i]) {
@@ -441,11 +722,11 @@ void UnionOperation::processReceivedData(query::DataResponse *response) {
         continue;
       }
       if (types[i] == query::INT)
-        col = deserializeChunk<int>(from_row, packet->data(i).c_str(), chunk_size);
+        col = viewChunk<int>(data[i], from_row, chunk_size, packet);
       else if (types[i] == query::DOUBLE)
-        col = deserializeChunk<double>(from_row, packet->data(i).c_str(), chunk_size);
+        col = viewChunk<double>(data[i], from_row, chunk_size, packet);
       else if (types[i] == query::BOOL)
-        col = deserializeChunk<char>(from_row, packet->data(i).c_str(), chunk_size);
+        col = viewChunk<char>(data[i], from_row, chunk_size, packet);
       else assert(false);
       chunk->push_back(col);
     }
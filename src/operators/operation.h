@@ -4,21 +4,82 @@
 #ifndef OPERATION_H
 #define OPERATION_H
 
+#include <cstdio>
 #include <iostream>
 #include <fstream>
 #include <vector>
 #include <queue>
-#include <tr1/unordered_map>
+#include <string>
 #include "node.h"
 #include "column.h"
 #include "factory.h"
 #include "expression.h"
-#include "keyvalue.h"
+#include "hashtable.h"
+#include "utils/pcqueue.h"
 
 #include "proto/operations.pb.h"
 
 using std::vector;
 
+class UnionOperation;
+class ReceivedPacket;
+
+/**
+ * Copies selected rows of the columns an operation reads, so it can work on
+ * dense chunks. Other columns are only resized, their data is garbage.
+ */
+class Compactor {
+  vector<bool> used;
+  vector<Column*> dense;
+ public:
+  Compactor(const vector<query::ColumnType>& types, const vector<bool>& used);
+  vector<Column*>* compact(vector<Column*>* columns,
+      const SelectionVector* selection);
+  ~Compactor();
+};
+
+/**
+ * Appends selected rows of sparse chunks into dense ones, so operations
+ * after a selective filter get chunks filled at least to COALESCE_FILL_RATIO
+ * instead of a few rows each. Counts fill ratios of chunks going in and out
+ * by tenths.
+ */
+class Coalescer {
+  static const int BUCKETS = 10;
+  vector<Column*> dense;
+  int rows; // in dense
+  bool flushed; // dense was returned, start over on append
+  long long inputFill[BUCKETS];
+  long long outputFill[BUCKETS];
+  static void count(long long* histogram, int rows);
+  static std::string print(const long long* histogram);
+ public:
+  Coalescer(const vector<query::ColumnType>& types);
+  /** Rows waiting in dense */
+  int size() {
+    return flushed ? 0 : rows;
+  }
+  /** Whether a chunk of that many rows should be appended */
+  bool sparse(int n) {
+    return n < COALESCE_FILL_RATIO * global::chunkSize;
+  }
+  bool fits(int n) {
+    return size() + n <= global::chunkSize;
+  }
+  void append(vector<Column*>* columns, const int* selected, int n);
+  /** Returns dense, valid until the next append */
+  vector<Column*>* flush();
+  void observeInput(int n) {
+    count(inputFill, n);
+  }
+  void observeOutput(int n) {
+    count(outputFill, n);
+  }
+  /** Fill ratio distributions, for logs */
+  std::string histogram();
+  ~Coalescer();
+};
+
 /** Base from all operations: scan, filter, group by, compute */
 class Operation : public Node {
  protected:
@@ -28,7 +89,20 @@ class Operation : public Node {
   virtual vector<query::ColumnType> getTypes() = 0;
   /** Pull next chunk of data */
   virtual vector<Column*>* pull() = 0;
-  virtual vector< vector<Column*> >* bucketsPull() {
+  /**
+   * Pull next chunk of data of which only rows in *selection are valid,
+   * NULL selection means all of them. Selection is never empty unless the
+   * chunk is.
+   */
+  virtual vector<Column*>* pullSelected(const SelectionVector** selection) {
+    *selection = NULL;
+    return pull();
+  }
+  /**
+   * Pull next chunk of data to be sent, (*buckets)[i] are its rows going to
+   * the i-th receiver. They are written straight into packets.
+   */
+  virtual vector<Column*>* bucketsPull(const vector< vector<int> >** buckets) {
     assert(false);
   }
   /** consume output at server */
@@ -49,7 +123,12 @@ class ScanOperation : public Operation {
 class ScanFileOperation : public Operation {
   vector<ColumnProvider*> providers;
   DataSourceInterface* source;
-  int sourceFileId;
+  int sourceFileId; // ASK_FOR_FILES to get them from the scheduler
+  bool filesLeft; // the scheduler may have more files
+  int filesScanned;
+  vector<Column*> eof; // empty chunks returned once there are no files
+  /** Opens the next file to scan, false if there are no more */
+  bool openSource();
  public:
   ScanFileOperation(const query::ScanFileOperation& oper);
   vector<Column*>* pull();
@@ -61,6 +140,8 @@ class ScanFileOperation : public Operation {
 class ComputeOperation : public Operation {
   Operation* source;
   vector<Expression*> expressions;
+  ExpressionContext context;
+  Compactor* compactor;
  public:
   ComputeOperation(const query::ComputeOperation& oper);
   vector<Column*>* pull();
@@ -72,26 +153,65 @@ class ComputeOperation : public Operation {
 class FilterOperation : public Operation {
   Operation* source;
   Expression* condition;
+  ExpressionContext context;
   vector<Column*> result;
+  SelectionVector selection;
+  Coalescer* coalescer;
+  // chunk pulled while rows were waiting in coalescer, served next time
+  vector<Column*>* held;
+  const SelectionVector* heldSelection;
+  bool heldSparse; // rows in selection are to be appended
  public:
   FilterOperation(const query::FilterOperation& oper);
+  /** Compacts selected rows, use pullSelected where possible */
   vector<Column*>* pull();
+  vector<Column*>* pullSelected(const SelectionVector** selected);
   std::ostream& debugPrint(std::ostream& output);
   vector<query::ColumnType> getTypes();
   ~FilterOperation();
 };
 
-typedef std::tr1::unordered_map<Key, Value, KeyHash, KeyEq> MapType;
-
 class GroupByOperation : public Operation {
+ protected:
   Operation* source;
   vector<int> groupByColumn;
   vector<int> aggregations; // non negative sum on idx, -1 count
-  MapType* m;
-  MapType::iterator it;
+  vector<query::ColumnType> keyTypes;
+  vector<query::ColumnType> aggregatedTypes;
+  bool partial;
+  Compactor* compactor;
+  /** Pulls from the source, selected rows only */
+  vector<Column*>* pullSource();
+  /** Adds aggregated values of rows of a chunk to aggregates at targets[row] */
+  void aggregate(vector<Column*>* sourceColumns, int n, any_t* const* targets);
+  /** Same as aggregate for rows all in one group, uses encodings of sums */
+  void aggregateGroup(vector<Column*>* sourceColumns, int n, any_t* target);
+  /** Encoding of the key column if it's a single encoded INT column */
+  const ChunkEncoding<int>* keyEncoding(vector<Column*>* sourceColumns);
+  /** Adds partial aggregates of the same group */
+  void merge(any_t* values, const any_t* partialValues);
+  /** Returns source rows as if each of them was a separate group */
+  vector<Column*>* passThrough(vector<Column*>* sourceColumns, int n);
+  virtual const char* getLayoutName() = 0;
+  // spilled groups, partitioned by hash
+  vector<FILE*> partitions;
+  long long spilledBytes;
+  /** Moves all groups from the table to partition files */
+  template<class Layout>
+  void spill(const Layout& layout, AggregationHashTable<Layout>* table);
+  /** Loads groups of a partition into the (empty) table, closes the file */
+  template<class Layout>
+  void loadPartition(const Layout& layout, unsigned partition,
+      AggregationHashTable<Layout>* table);
  public:
-  GroupByOperation(const query::GroupByOperation& oper);
-  vector<Column*>* pull();
+  enum KeyLayout {
+    INT32_KEY, // single INT or BOOL key
+    PACKED_KEY, // two INT or BOOL keys packed into uint64
+    GENERIC_KEY
+  };
+  static KeyLayout chooseKeyLayout(const vector<query::ColumnType>& keyTypes);
+
+  GroupByOperation(const query::GroupByOperation& oper, Operation* source);
   std::ostream& debugPrint(std::ostream& output);
   vector<query::ColumnType> getTypes();
   vector<int> getKeyColumnsId();
@@ -99,18 +219,86 @@ class GroupByOperation : public Operation {
   ~GroupByOperation();
 };
 
+/** Group by specialized for a key layout from hashtable.h */
+template<class Layout>
+class GroupByOperationImpl : public GroupByOperation {
+  Layout layout;
+  vector<typename Layout::Word> keyBuffer; // encoded keys of a chunk
+  AggregationHashTable<Layout>* table;
+  int served; // number of groups already returned
+  bool sourceFinished;
+  // partial group by only
+  bool draining; // serve groups before consuming more rows
+  bool passingThrough;
+  long long consumedRows;
+  unsigned nextPartition; // spilled one to load
+
+  /** Aggregates next chunk from the source, returns its size */
+  int consumeChunk();
+  /** Groups of keys, looked up once per distinct value of the encoding */
+  void findEncoded(const ChunkEncoding<int>* encoding,
+      const typename Layout::Word* keys, int n, int* groups);
+  /** Returns the next chunk of groups from the table */
+  vector<Column*>* serve();
+  vector<Column*>* pullPartial();
+ protected:
+  const char* getLayoutName();
+ public:
+  GroupByOperationImpl(const query::GroupByOperation& oper, Operation* source);
+  vector<Column*>* pull();
+  ~GroupByOperationImpl();
+};
+
+/**
+ * Group by of rows received from other nodes, aggregated by several threads.
+ * Received chunks are handed out to threads as they arrive and each thread
+ * keeps a table per hash partition. Afterwards a thread per partition merges
+ * tables of all threads, so merged partitions are disjoint and can be served
+ * one after another.
+ * A thread whose groups take more than its share of the memory budget
+ * spills its tables. Once any did, all the groups are spilled at the end of
+ * input and the spill partitions are loaded and served one by one instead.
+ */
+template<class Layout>
+class ParallelGroupByOperation : public GroupByOperation {
+  Layout layout;
+  UnionOperation* chunkSource;
+  int threads; // also number of partitions
+  vector< vector<AggregationHashTable<Layout>*> > tables; // [thread][partition]
+  util::PCQueue<vector<Column*>*> chunks; // NULL is the end of data
+  boost::mutex spillMutex; // threads share the partition files
+  bool aggregated;
+  int partition; // being served, of spilled ones if any
+  int served; // groups of the partition already returned
+
+  /** Thread body: aggregates chunks from the queue into tables[thread] */
+  void aggregateChunks(int thread);
+  /** Thread body: merges partition of all threads into tables[0] */
+  void mergePartition(int partition);
+  /** Bytes held by arenas of the tables */
+  size_t memoryUsage();
+  size_t memoryUsage(int thread);
+ protected:
+  const char* getLayoutName();
+ public:
+  ParallelGroupByOperation(const query::GroupByOperation& oper,
+      UnionOperation* source, int threads);
+  vector<Column*>* pull();
+  ~ParallelGroupByOperation();
+};
+
 class ShuffleOperation : public Operation {
   Operation* source;
   unsigned int receiversCount;
   std::vector<int> columns;
   std::vector<query::ColumnType> columnTypes;
   std::vector<int> hashColumns;
-  vector< vector<Column*> > buckets;
+  vector< vector<int> > buckets; // rows of the chunk
   Column* columnsHash;
  public:
   ShuffleOperation(const query::ShuffleOperation& oper);
   vector<Column*>* pull(); // can't use!
-  vector< vector<Column*> >* bucketsPull();
+  vector<Column*>* bucketsPull(const vector< vector<int> >** buckets);
   std::ostream& debugPrint(std::ostream& output);
   vector<query::ColumnType> getTypes();
   ~ShuffleOperation();
@@ -126,12 +314,19 @@ class UnionOperation : public Operation {
   std::queue<vector<Column*>*> cache;
   vector<Column*>* tmp;
   bool firstPull;
-  void processReceivedData(query::DataResponse *response);
+  /** Chunks of used columns point into the packet, which they keep alive */
+  void processReceivedData(query::DataResponse *response,
+      const boost::shared_ptr<ReceivedPacket>& packet);
   vector<Column*> eof;
-  void deleteChunkData(vector<Column*>* chunk);
  public:
   UnionOperation(const query::UnionOperation& oper);
   vector<Column*>* pull();
+  /**
+   * Like pull, but the caller owns the chunk and frees it with
+   * deleteChunkData and delete. Returns NULL at the end of data.
+   */
+  vector<Column*>* pullOwned();
+  void deleteChunkData(vector<Column*>* chunk);
   std::ostream& debugPrint(std::ostream& output);
   vector<query::ColumnType> getTypes();
   ~UnionOperation();
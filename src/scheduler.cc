@@ -45,6 +45,16 @@ int main(int argc, char** argv) {
   queryFile.Close();
   close(queryFd);
 
+  /**
+   * Rows of column chunks, DEFAULT_CHUNK_SIZE unless CHUNK_SIZE is set,
+   * e.g. to the best size of exec_plan --sweep-chunk-sizes. Stripes carry
+   * it to the workers.
+   */
+  const char* chunkSize = getenv("CHUNK_SIZE");
+  if (chunkSize != NULL) {
+    global::setChunkSize(atoi(chunkSize));
+  }
+
   /** Set up network environment */
   boost::scoped_ptr<NodeEnvironmentInterface> nei(
       CreateNodeEnvironment(argc - 2, argv + 2));
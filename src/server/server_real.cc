@@ -346,7 +346,12 @@ public:
    return value < dynamic_cast<const DoubleTestValue&>(other).value;
   }
   virtual void print() const {
-    //printf("%f", value);
+    // the sign of nan depends on the libm
+    if (std::isnan(value)) {
+      printf("nan");
+    } else {
+      printf("%f", value);
+    }
   }
 private:
   double value;
@@ -360,7 +365,7 @@ public:
     return value < dynamic_cast<const IntTestValue&>(other).value;
   }
   virtual void print() const {
-    //printf("%d", value);
+    printf("%d", value);
   }
 private:
   int value;
@@ -373,7 +378,7 @@ public:
     return value < dynamic_cast<const BoolTestValue&>(other).value;
   }
   virtual void print() const {
-    //value ? printf("TRUE") : printf("FALSE");
+    value ? printf("TRUE") : printf("FALSE");
   }
 private:
   bool value;
@@ -783,6 +788,9 @@ vector<int> ColumnMap(int query_id) {
     case 10: return CreateVector(3, 1);
     case 11: return CreateVector(1, 2);
     case 12: return CreateVector(1, 1, 2);
+    case 13: return CreateVector(1, 2);
+    case 14: return CreateVector(1, 2, 3);
+    case 15: return CreateVector(1, 2, 1, 3);
     default: assert(false);
   }
 }
@@ -793,7 +801,8 @@ Server *CreateServer(int query_id, std::string variant) {
   } else if (variant == "test") {
     // if query contains groupby then we should sort output before dumping
     // to not depend on hashmap ordering
-    bool query_with_groupby = 7 <= query_id && query_id <= 11;
+    bool query_with_groupby =
+        (7 <= query_id && query_id <= 11) || query_id == 15;
     return new TestDataServer(ColumnMap(query_id), query_with_groupby);
   } else if (variant == "perf") {
     bool save_memory = (query_id == 7);
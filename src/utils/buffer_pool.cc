@@ -0,0 +1,144 @@
+/*
+ * buffer_pool.cc
+ */
+
+#include "buffer_pool.h"
+
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "utils/logger.h"
+
+namespace util {
+
+BufferPool& BufferPool::Instance() {
+  // Not destroyed, buffers may be released by destructors of statics.
+  static BufferPool* pool = new BufferPool();
+  return *pool;
+}
+
+uint32_t BufferPool::ClassOf(std::size_t bytes) {
+  uint32_t size_class = 0;
+  while (size_class < kClasses &&
+         (std::size_t(1) << (kMinClassBits + size_class)) < bytes) {
+    size_class++;
+  }
+  return size_class;
+}
+
+BufferPool::Header* BufferPool::HeaderOf(const void* buffer) {
+  return reinterpret_cast<Header*>(
+      const_cast<char*>(static_cast<const char*>(buffer)) - kAlignment);
+}
+
+std::size_t BufferPool::Capacity(const void* buffer) {
+  return HeaderOf(buffer)->bytes;
+}
+
+void* BufferPool::Allocate(std::size_t bytes) {
+  uint32_t size_class = ClassOf(bytes);
+
+  SizeClass& pooled = classes_[size_class];
+  Header* header = NULL;
+  {
+    boost::mutex::scoped_lock lock(pooled.mutex);
+    if (!pooled.free.empty()) {
+      header = pooled.free.back();
+      pooled.free.pop_back();
+      pooled.hits++;
+    } else {
+      pooled.misses++;
+    }
+  }
+  if (header == NULL) {
+    if (size_class < kClasses) {
+      bytes = std::size_t(1) << (kMinClassBits + size_class);
+    }
+    header = AllocateHeader(bytes, size_class);
+  }
+  return reinterpret_cast<char*>(header) + kAlignment;
+}
+
+void BufferPool::Release(void* buffer) {
+  if (buffer == NULL) return;
+  Header* header = HeaderOf(buffer);
+  if (header->size_class < kClasses) {
+    SizeClass& pooled = classes_[header->size_class];
+    boost::mutex::scoped_lock lock(pooled.mutex);
+    if ((pooled.free.size() + 1) * header->bytes <= kMaxPooledBytesPerClass) {
+      pooled.free.push_back(header);
+      return;
+    }
+  }
+  FreeHeader(header);
+}
+
+uint64_t BufferPool::hits() {
+  uint64_t result = 0;
+  for (int i = 0; i <= kClasses; i++) {
+    boost::mutex::scoped_lock lock(classes_[i].mutex);
+    result += classes_[i].hits;
+  }
+  return result;
+}
+
+uint64_t BufferPool::misses() {
+  uint64_t result = 0;
+  for (int i = 0; i <= kClasses; i++) {
+    boost::mutex::scoped_lock lock(classes_[i].mutex);
+    result += classes_[i].misses;
+  }
+  return result;
+}
+
+BufferPool::Header* BufferPool::AllocateHeader(std::size_t bytes,
+                                               uint32_t size_class) {
+  Header* header = NULL;
+  bool mapped = false;
+  if (huge_pages_ && bytes >= kHugePageBytes) {
+    // a huge page more than needed, trimmed so the buffer starts at one
+    std::size_t length = kPageBytes + bytes + kHugePageBytes;
+    void* memory = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory != MAP_FAILED) {
+      char* start = static_cast<char*>(memory);
+      char* buffer = reinterpret_cast<char*>(
+          (reinterpret_cast<uintptr_t>(start) + kPageBytes + kHugePageBytes - 1)
+          / kHugePageBytes * kHugePageBytes);
+      char* end = start + length;
+      if (buffer - kPageBytes > start) {
+        munmap(start, buffer - kPageBytes - start);
+      }
+      char* tail = buffer + (bytes + kPageBytes - 1) / kPageBytes * kPageBytes;
+      if (tail < end) {
+        munmap(tail, end - tail);
+      }
+#ifdef MADV_HUGEPAGE
+      madvise(buffer, bytes, MADV_HUGEPAGE);
+#endif
+      header = HeaderOf(buffer);
+      mapped = true;
+    }
+  }
+  if (header == NULL) {
+    void* memory = NULL;
+    CHECK(posix_memalign(&memory, kAlignment, kAlignment + bytes) == 0,
+          "Out of memory");
+    header = static_cast<Header*>(memory);
+  }
+  header->size_class = size_class;
+  header->mapped = mapped;
+  header->bytes = bytes;
+  return header;
+}
+
+void BufferPool::FreeHeader(Header* header) {
+  if (header->mapped) {
+    char* buffer = reinterpret_cast<char*>(header) + kAlignment;
+    munmap(buffer - kPageBytes, kPageBytes + header->bytes);
+  } else {
+    free(header);
+  }
+}
+
+}  // namespace util
@@ -0,0 +1,88 @@
+/*
+ * buffer_pool.h
+ *
+ * Process wide pool of large buffers: column chunks, packets being built
+ * and packets being received. Buffers are kept in power of two size
+ * classes, so a released buffer is reused by the next allocation of a
+ * similar size instead of going through the allocator (and page faults).
+ */
+
+#ifndef BUFFER_POOL_H_
+#define BUFFER_POOL_H_
+
+#include <stdint.h>
+#include <cstddef>
+#include <vector>
+#include <boost/thread/mutex.hpp>
+#include <boost/utility.hpp>
+
+namespace util {
+
+// The class is thread safe.
+class BufferPool : boost::noncopyable {
+ public:
+  // The pool of the process, never destroyed.
+  static BufferPool& Instance();
+
+  // Returns a buffer of at least |bytes| bytes aligned to kAlignment.
+  void* Allocate(std::size_t bytes);
+
+  // Returns a buffer obtained from Allocate to the pool.
+  void Release(void* buffer);
+
+  // Bytes usable in a buffer obtained from Allocate, the size of its class.
+  static std::size_t Capacity(const void* buffer);
+
+  // Size class of buffers of |bytes| bytes, class c holds buffers of
+  // 2^(kMinClassBits + c) bytes. kClasses if they aren't pooled.
+  static uint32_t ClassOf(std::size_t bytes);
+
+  // Buffers of huge size classes allocated from now on are backed by
+  // transparent huge pages.
+  void set_huge_pages(bool huge_pages) { huge_pages_ = huge_pages; }
+
+  // Allocations served from / not served from the pool.
+  uint64_t hits();
+  uint64_t misses();
+
+  static const std::size_t kAlignment = 64;  // a cache line
+  static const int kMinClassBits = 8;  // 256 bytes
+  static const int kMaxClassBits = 26;  // 64MB, larger aren't pooled
+  static const int kClasses = kMaxClassBits - kMinClassBits + 1;
+
+ private:
+  static const std::size_t kHugePageBytes = 2 * 1024 * 1024;
+  static const std::size_t kPageBytes = 4096;
+  // Released buffers of a class are kept up to this size in total.
+  static const std::size_t kMaxPooledBytesPerClass = 64 * 1024 * 1024;
+
+  // Takes kAlignment bytes before every buffer, outside of its class size.
+  // Mapped buffers start at a huge page, the header ends the page before.
+  struct Header {
+    uint32_t size_class;  // kClasses if not pooled
+    uint32_t mapped;  // by mmap rather than malloc
+    std::size_t bytes;  // of the buffer, without the header
+  };
+
+  static Header* HeaderOf(const void* buffer);
+
+  struct SizeClass {
+    boost::mutex mutex;
+    std::vector<Header*> free;
+    uint64_t hits;
+    uint64_t misses;
+    SizeClass() : hits(0), misses(0) {}
+  };
+
+  BufferPool() : huge_pages_(false) {}
+
+  Header* AllocateHeader(std::size_t bytes, uint32_t size_class);
+  void FreeHeader(Header* header);
+
+  bool huge_pages_;
+  SizeClass classes_[kClasses + 1];  // the last one counts unpooled
+};
+
+}  // namespace util
+
+#endif /* BUFFER_POOL_H_ */
@@ -7,6 +7,7 @@
 #include <google/protobuf/text_format.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
 
 using google::protobuf::TextFormat;
 using google::protobuf::io::FileInputStream;
@@ -16,6 +17,7 @@ using google::protobuf::io::FileInputStream;
 #include "operators/operation.h"
 #include "node_environment/node_environment.h"
 #include "distributed/node.h"
+#include "utils/buffer_pool.h"
 
 #include "proto/operations.pb.h"
 
@@ -43,6 +45,25 @@ int main(int argc, char** argv) {
   boost::scoped_ptr<NodeEnvironmentInterface> nei(
       CreateNodeEnvironment(argc, argv));
 
+  /** Group by uses all cores unless GROUP_BY_THREADS is set */
+  const char* threads = getenv("GROUP_BY_THREADS");
+  Factory::groupByThreads = threads != NULL ? atoi(threads) :
+    boost::thread::hardware_concurrency();
+  if (Factory::groupByThreads < 1) {
+    Factory::groupByThreads = 1;
+  }
+
+  /** Group by spills above GROUP_BY_MEMORY_LIMIT bytes if set */
+  const char* memoryLimit = getenv("GROUP_BY_MEMORY_LIMIT");
+  if (memoryLimit != NULL) {
+    global::groupByMemoryLimit = strtoull(memoryLimit, NULL, 10);
+  }
+
+  /** Large buffers use transparent huge pages if BUFFER_POOL_HUGE_PAGES=1 */
+  const char* hugePages = getenv("BUFFER_POOL_HUGE_PAGES");
+  util::BufferPool::Instance().set_huge_pages(hugePages != NULL &&
+      atoi(hugePages) != 0);
+
   /** Run job */
   WorkerNode worker(nei.get());
   worker.run();
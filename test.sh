@@ -13,11 +13,13 @@ A_RED="\033[31m"
 
 mkdir -p "$TEST_ACTUAL"
 
+src/buffer_pool_test || { echo -e "\n Test(buffer_pool) ${A_RED}FAILED${A_RESET}\n"; exit 1; }
+
 function printOutput() {
   cat "$TEST_ACTUAL/q$1"
 }
 
-for i in {1..9}; do
+for i in {1..9} {13..15}; do
   ($CODWH_BIN --server test $i $QUERIES/q$i.ascii > "$TEST_ACTUAL/q$i") || { printOutput $i; echo -e "\n"; }
   diff "$TEST_EXPECTED/q$i" "$TEST_ACTUAL/q$i" || { echo -e "\n Test($i) ${A_RED}FAILED${A_RESET}\n"; exit 1; }
 done